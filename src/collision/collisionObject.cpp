@@ -0,0 +1,10 @@
+#include "../particleStore.h"
+#include "collisionObject.h"
+
+void CollisionObject::collide_particles(ParticleStore &particles, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; i++) collide_particle(particles[i]);
+}
+
+void CollisionObject::collide_indexed(ParticleStore &particles, const uint32_t *indices, size_t count) {
+  for (size_t k = 0; k < count; k++) collide_particle(particles[indices[k]]);
+}
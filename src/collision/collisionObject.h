@@ -1,6 +1,7 @@
 #ifndef COLLISIONOBJECT
 #define COLLISIONOBJECT
 
+#include <cstdint>
 #include <nanogui/nanogui.h>
 // #include "particle.h"
 
@@ -8,11 +9,23 @@ using namespace CGL;
 using namespace std;
 using namespace nanogui;
 
-class Particle;
+struct ParticleRef;
+struct ParticleStore;
 class CollisionObject {
 public:
+  virtual ~CollisionObject() {}
   virtual void render(GLShader &shader)=0;
-  virtual void collide_particle(Particle &pm)=0;
+  virtual void collide_particle(ParticleRef pm)=0;
+  // Collides particles begin..end-1 of the store, so the solver makes one
+  // call per object for a whole block of particles. Blocks of different
+  // threads may run at the same time. The default calls collide_particle
+  // on each particle.
+  virtual void collide_particles(ParticleStore &particles, size_t begin, size_t end);
+  // Same for the count particles listed in indices, in increasing order
+  virtual void collide_indexed(ParticleStore &particles, const uint32_t *indices, size_t count);
+  // Box outside of which collide_particle never moves a particle, for the
+  // broad phase; false if there is none, as for planes
+  virtual bool bounds(Vector3D &lo, Vector3D &hi) const { return false; }
   double friction;
 };
 
@@ -0,0 +1,47 @@
+#include <cmath>
+
+#include "container.h"
+
+using namespace std;
+using namespace CGL;
+
+Container *Container::from_planes(const vector<Plane *> &planes) {
+  vector<Plane *> by_axis[3];
+  for (Plane *plane : planes) {
+    int axis = -1, zeros = 0;
+    for (int a = 0; a < 3; a++) {
+      if (plane->normal[a] == 0) zeros++;
+      else axis = a;
+    }
+    if (zeros != 2) return NULL;
+    by_axis[axis].push_back(plane);
+  }
+
+  Vector3D lo, hi;
+  double friction_lo[3], friction_hi[3];
+  for (int axis = 0; axis < 3; axis++) {
+    if (by_axis[axis].size() != 2) return NULL;
+    Plane *first = by_axis[axis][0], *second = by_axis[axis][1];
+    if (first->point[axis] == second->point[axis]) return NULL;
+    if (first->point[axis] > second->point[axis]) swap(first, second);
+    lo[axis] = first->point[axis];
+    hi[axis] = second->point[axis];
+    friction_lo[axis] = first->friction;
+    friction_hi[axis] = second->friction;
+  }
+
+  Container *box = new Container(lo, hi);
+  for (int axis = 0; axis < 3; axis++) {
+    box->friction_lo[axis] = friction_lo[axis];
+    box->friction_hi[axis] = friction_hi[axis];
+  }
+  return box;
+}
+
+Container *Container::find(const vector<CollisionObject *> *objects) {
+  for (CollisionObject *co : *objects) {
+    Container *box = dynamic_cast<Container *>(co);
+    if (box != NULL) return box;
+  }
+  return NULL;
+}
@@ -0,0 +1,64 @@
+#ifndef COLLISIONOBJECT_CONTAINER_H
+#define COLLISIONOBJECT_CONTAINER_H
+
+#include <vector>
+#include <nanogui/nanogui.h>
+
+#include "CGL/CGL.h"
+#include "CGL/vector3D.h"
+#include "collisionObject.h"
+#include "particle.h"
+#include "plane.h"
+#include "../particleStore.h"
+
+using namespace nanogui;
+using namespace CGL;
+using namespace std;
+
+#define CONTAINER_SURFACE_OFFSET 1e-6
+
+/*
+  Axis-aligned box the fluid is kept inside, standing in for the six planes
+  of a "boundingBox" whose normals are all axis-aligned. Each axis is one
+  clamp: a particle that moves past a face is put back on the face like
+  Plane does, with that face's friction. Unlike the planes, the box does not
+  stop particles that are already outside from moving in. contain() is
+  inline so the solvers can run it in their own position loops.
+*/
+struct Container : public CollisionObject {
+public:
+  Container(const Vector3D &lo, const Vector3D &hi) : lo(lo), hi(hi) {
+    for (int axis = 0; axis < 3; axis++) friction_lo[axis] = friction_hi[axis] = 0;
+  }
+
+  // The box the planes bound, or NULL unless every plane is axis-aligned
+  // and each axis has two of them at different places
+  static Container *from_planes(const vector<Plane *> &planes);
+  // The first Container among objects, or NULL
+  static Container *find(const vector<CollisionObject *> *objects);
+
+  void render(GLShader &shader) {}
+  void collide_particle(ParticleRef pm) { contain(pm.x_star, pm.origin); }
+  void collide_particles(ParticleStore &particles, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) contain(particles.x_star[i], particles.origin[i]);
+  }
+
+  inline void contain(Vector3D &x_star, const Vector3D &origin) const {
+    for (int axis = 0; axis < 3; axis++) {
+      double x = x_star[axis];
+      bool below = x < lo[axis] && origin[axis] >= lo[axis];
+      bool above = x > hi[axis] && origin[axis] <= hi[axis];
+      if (!(below || above)) continue;
+      double friction = below ? friction_lo[axis] : friction_hi[axis];
+      Vector3D intersect_point = x_star;
+      intersect_point[axis] = below ? lo[axis] + CONTAINER_SURFACE_OFFSET : hi[axis] - CONTAINER_SURFACE_OFFSET;
+      x_star = origin + (intersect_point - origin) * (1 - friction);
+    }
+  }
+
+  Vector3D lo, hi;
+  double friction_lo[3];
+  double friction_hi[3];
+};
+
+#endif /* COLLISIONOBJECT_CONTAINER_H */
@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <cfloat>
+#include <nanogui/nanogui.h>
+
+#include "mesh.h"
+
+using namespace std;
+using namespace CGL;
+
+#define SURFACE_OFFSET 1e-6
+#define LEAF_TRIANGLES 4
+#define MAX_PASSES 3
+
+TriangleMesh::TriangleMesh(const vector<Vector3D> &vertices, const vector<uint32_t> &indices,
+                           double friction)
+    : friction(friction), vertices(vertices), indices(indices) {
+  size_t num_triangles = indices.size()/3;
+  vector<Vector3D> centroids(num_triangles);
+  for (size_t t = 0; t < num_triangles; t++) {
+    const Vector3D &a = vertices[indices[3*t]];
+    const Vector3D &b = vertices[indices[3*t + 1]];
+    const Vector3D &c = vertices[indices[3*t + 2]];
+    Vector3D normal = cross(b - a, c - a);
+    // Degenerate triangles keep a zero normal and are never crossed
+    normals.push_back(normal.norm() > 0 ? normal.unit() : Vector3D());
+    centroids[t] = (a + b + c)/3.0;
+    order.push_back(t);
+  }
+
+  nodes.push_back(Node());
+  if (num_triangles > 0) build(0, 0, num_triangles, centroids);
+}
+
+void TriangleMesh::build(uint32_t node, uint32_t begin, uint32_t end,
+                         const vector<Vector3D> &centroids) {
+  // Median split along the longest axis of the centroids
+  Vector3D lo(DBL_MAX, DBL_MAX, DBL_MAX), hi(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+  Vector3D c_lo = lo, c_hi = hi;
+  for (uint32_t k = begin; k < end; k++) {
+    uint32_t t = order[k];
+    for (int v = 0; v < 3; v++) {
+      const Vector3D &p = vertices[indices[3*t + v]];
+      for (int axis = 0; axis < 3; axis++) {
+        lo[axis] = min(lo[axis], p[axis]);
+        hi[axis] = max(hi[axis], p[axis]);
+      }
+    }
+    for (int axis = 0; axis < 3; axis++) {
+      c_lo[axis] = min(c_lo[axis], centroids[t][axis]);
+      c_hi[axis] = max(c_hi[axis], centroids[t][axis]);
+    }
+  }
+  nodes[node].lo = lo;
+  nodes[node].hi = hi;
+
+  if (end - begin <= LEAF_TRIANGLES) {
+    nodes[node].first = begin;
+    nodes[node].count = end - begin;
+    return;
+  }
+
+  Vector3D extent = c_hi - c_lo;
+  int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+  uint32_t mid = begin + (end - begin)/2;
+  nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+              [&](uint32_t s, uint32_t t) { return centroids[s][axis] < centroids[t][axis]; });
+
+  uint32_t left = nodes.size();
+  nodes.push_back(Node());
+  nodes.push_back(Node());
+  nodes[node].first = left;
+  nodes[node].count = 0;
+  build(left, begin, mid, centroids);
+  build(left + 1, mid, end, centroids);
+}
+
+double TriangleMesh::first_hit(const Vector3D &a, const Vector3D &b, uint32_t &tri) const {
+  Vector3D d = b - a;
+  Vector3D inv_d(1/d.x, 1/d.y, 1/d.z);
+  double best = 2;
+
+  uint32_t stack[64];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const Node &node = nodes[stack[--top]];
+
+    // Slab test of the segment, cut off at the best crossing so far
+    double t_min = 0, t_max = best;
+    for (int axis = 0; axis < 3; axis++) {
+      double t0 = (node.lo[axis] - a[axis])*inv_d[axis];
+      double t1 = (node.hi[axis] - a[axis])*inv_d[axis];
+      if (t0 > t1) swap(t0, t1);
+      t_min = max(t_min, t0);
+      t_max = min(t_max, t1);
+    }
+    if (t_min > t_max) continue;
+
+    if (node.count == 0) {
+      stack[top++] = node.first;
+      stack[top++] = node.first + 1;
+      continue;
+    }
+
+    for (uint32_t k = node.first; k < node.first + node.count; k++) {
+      uint32_t t = order[k];
+      const Vector3D &n = normals[t];
+      const Vector3D &v0 = vertices[indices[3*t]];
+      double side_a = dot(a - v0, n);
+      double side_b = dot(b - v0, n);
+      if ((side_a > 0) == (side_b > 0)) continue;
+
+      double s = side_a/(side_a - side_b);
+      if (s >= best) continue;
+      Vector3D p = a + s*d;
+
+      // Inside if p is on the inner side of all three edges
+      bool inside = true;
+      for (int v = 0; v < 3 && inside; v++) {
+        const Vector3D &from = vertices[indices[3*t + v]];
+        const Vector3D &to = vertices[indices[3*t + (v + 1)%3]];
+        inside = dot(cross(to - from, p - from), n) >= 0;
+      }
+      if (inside) {
+        best = s;
+        tri = t;
+      }
+    }
+  }
+  return best <= 1 ? best : -1;
+}
+
+bool TriangleMesh::bounds(Vector3D &lo, Vector3D &hi) const {
+  // The root box holds every triangle
+  if (order.empty()) return false;
+  lo = nodes[0].lo;
+  hi = nodes[0].hi;
+  return true;
+}
+
+void TriangleMesh::collide_particle(ParticleRef pm) {
+  for (int pass = 0; pass < MAX_PASSES; pass++) {
+    uint32_t t;
+    if (first_hit(pm.origin, pm.x_star, t) < 0) return;
+
+    const Vector3D &n = normals[t];
+    const Vector3D &v0 = vertices[indices[3*t]];
+    Vector3D intersect_point = pm.x_star + dot(v0 - pm.x_star, n)*n;
+    Vector3D outward = dot(pm.origin - v0, n) > 0 ? n : -n;
+    Vector3D correction_vector = intersect_point - pm.origin + outward*SURFACE_OFFSET;
+    pm.x_star = pm.origin + correction_vector*(1 - friction);
+  }
+}
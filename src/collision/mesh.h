@@ -0,0 +1,57 @@
+#ifndef COLLISIONOBJECT_MESH_H
+#define COLLISIONOBJECT_MESH_H
+
+#include <cstdint>
+#include <vector>
+#include <nanogui/nanogui.h>
+
+#include "CGL/CGL.h"
+#include "CGL/vector3D.h"
+#include "collisionObject.h"
+#include "particle.h"
+
+using namespace nanogui;
+using namespace CGL;
+using namespace std;
+
+/*
+  Triangle mesh obstacle, e.g. an OBJ file, with its triangles in a
+  bounding volume hierarchy: a particle only tests the triangles whose
+  boxes the segment from origin to x_star passes through. The first
+  triangle the segment crosses moves x_star onto that triangle's plane, on
+  the origin side, like Plane does. As that can cross another triangle at
+  a crease, the query is repeated a few times.
+*/
+struct TriangleMesh : public CollisionObject {
+public:
+  // indices holds three vertex indices per triangle
+  TriangleMesh(const vector<Vector3D> &vertices, const vector<uint32_t> &indices, double friction);
+
+  void render(GLShader &shader) {}
+  void collide_particle(ParticleRef pm);
+  bool bounds(Vector3D &lo, Vector3D &hi) const;
+
+  size_t num_triangles() const { return order.size(); }
+
+  double friction;
+
+private:
+  struct Node {
+    Vector3D lo, hi;
+    uint32_t first;  // first entry of order for a leaf, else the left child
+    uint32_t count;  // triangles in a leaf, 0 for an inner node
+  };
+
+  void build(uint32_t node, uint32_t begin, uint32_t end, const vector<Vector3D> &centroids);
+  // Fraction of the way from a to b where it first crosses a triangle, or
+  // -1 if it crosses none; tri is the triangle crossed
+  double first_hit(const Vector3D &a, const Vector3D &b, uint32_t &tri) const;
+
+  vector<Vector3D> vertices;
+  vector<uint32_t> indices;
+  vector<Vector3D> normals;  // unit normal per triangle
+  vector<uint32_t> order;    // triangles ordered so every leaf is a range
+  vector<Node> nodes;        // the children of an inner node are adjacent
+};
+
+#endif /* COLLISIONOBJECT_MESH_H */
@@ -6,7 +6,7 @@
 using namespace nanogui;
 using namespace CGL;
 
-void Particle::collide_particle(Particle &pm) {
+void Particle::collide_particle(ParticleRef pm) {
   // TODO (Part 3.1): Handle collisions with spheres.
 	Vector3D d = pm.origin - origin;
 	if (d.norm() <= radius + pm.radius) {
@@ -19,7 +19,7 @@ public:
         friction(friction) {}
 
   void render(nanogui::GLShader &shader);
-  void collide_particle(Particle &pm);
+  void collide_particle(ParticleRef pm);
 
   Vector3D origin;
   Vector3D last_origin;
@@ -41,4 +41,27 @@ public:
 
 };
 
+/*
+  Accessor view of one fluid particle. Fluid keeps its particles as
+  structure-of-arrays (see ParticleStore); a ParticleRef gathers references
+  to one particle's fields so per-particle code reads like the old struct.
+*/
+struct ParticleRef {
+  Vector3D &origin;
+  Vector3D &last_origin;
+  Vector3D &start_origin;
+  Vector3D &color;
+  Vector3D &x_star;
+  double &density;
+  Vector3D &delta_p;
+  Vector3D &forces;
+  Vector3D &omega;
+  Vector3D &velocity;
+  double &lambda;
+  uint32_t &id;
+
+  double radius;
+  double friction;
+};
+
 #endif /* COLLISIONOBJECT_PARTICLE_H */
@@ -3,13 +3,14 @@
 
 #include "../fluidSimulator.h"
 #include "plane.h"
+#include "../particleStore.h"
 
 using namespace std;
 using namespace CGL;
 
 #define SURFACE_OFFSET 1e-6
 
-// void Plane::collide_particle(Particle &pm) {
+// void Plane::collide_particle(ParticleRef pm) {
 //   // TODO (Part 3.2): Handle collisions with planes.
 //   float last_side = dot(pm.last_origin-point, normal);
 //   float current_side = dot(pm.origin-point, normal);
@@ -31,7 +32,7 @@ using namespace CGL;
 //   }
 // }
 
-void Plane::collide_particle(Particle &pm) {
+void Plane::collide_particle(ParticleRef pm) {
   // TODO (Part 3.2): Handle collisions with planes.
   float last_side = dot(pm.origin-point, normal);
   float current_side = dot(pm.x_star-point, normal);
@@ -53,6 +54,24 @@ void Plane::collide_particle(Particle &pm) {
   }
 }
 
+void Plane::collide_particles(ParticleStore &particles, size_t begin, size_t end) {
+  // collide_particle straight on the position arrays, with both crossing
+  // directions in one branch
+  Vector3D *x_star = particles.x_star.data();
+  const Vector3D *origin = particles.origin.data();
+  double nn = dot(normal, normal);
+  for (size_t i = begin; i < end; i++) {
+    double current_side = dot(point - x_star[i], normal);
+    double last_side = dot(point - origin[i], normal);
+    if ((current_side > 0.0 && !(last_side > 0.0)) || (current_side < 0.0 && !(last_side < 0.0))) {
+      Vector3D offset = current_side > 0.0 ? normal * SURFACE_OFFSET : -normal * SURFACE_OFFSET;
+      Vector3D intersect_point = x_star[i] + (current_side / nn) * normal;
+      Vector3D correction_vector = intersect_point - origin[i] + offset;
+      x_star[i] = origin[i] + correction_vector * (1 - friction);
+    }
+  }
+}
+
 void Plane::render(GLShader &shader) {
   /*nanogui::Color color(0.7f, 0.7f, 0.7f, 1.0f);
 
@@ -16,7 +16,8 @@ public:
       : point(point), normal(normal.unit()), friction(friction) {}
 
   void render(GLShader &shader);
-  void collide_particle(Particle &pm);
+  void collide_particle(ParticleRef pm);
+  void collide_particles(ParticleStore &particles, size_t begin, size_t end);
 
   Vector3D point;
   Vector3D normal;
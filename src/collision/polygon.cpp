@@ -10,7 +10,7 @@ using namespace CGL;
 
 
 
-bool Polygon::particle_in_polygon(Particle &pm) {
+bool Polygon::particle_in_polygon(ParticleRef pm) {
   for (int i = 0; i < vertices.size(); i++) {
     int k = i-1;
     if (k < 0) k = vertices.size();
@@ -22,7 +22,7 @@ bool Polygon::particle_in_polygon(Particle &pm) {
   return true;
 }
 
-void Polygon::collide_particle(Particle &pm) {
+void Polygon::collide_particle(ParticleRef pm) {
   // TODO (Part 3.2): Handle collisions with planes.
   float last_side = dot(pm.origin-point, normal);
   float current_side = dot(pm.x_star-point, normal);
@@ -21,8 +21,8 @@ public:
   }
 
   void render(GLShader &shader);
-  void collide_particle(Particle &pm);
-  bool particle_in_polygon(Particle &pm);
+  void collide_particle(ParticleRef pm);
+  bool particle_in_polygon(ParticleRef pm);
 
   Plane* plane;
   std::vector<Vector3D> vertices;
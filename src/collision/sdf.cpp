@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <nanogui/nanogui.h>
+
+#include "sdf.h"
+
+using namespace std;
+using namespace CGL;
+
+#define SURFACE_OFFSET 1e-6
+#define MAX_PASSES 3
+#define MIN_GRADIENT 0.9
+
+// Closest point to p on the triangle abc (Ericson, Real-Time Collision
+// Detection, 5.1.5)
+static Vector3D closest_on_triangle(const Vector3D &p, const Vector3D &a, const Vector3D &b,
+                                    const Vector3D &c) {
+  Vector3D ab = b - a, ac = c - a, ap = p - a;
+  double d1 = dot(ab, ap), d2 = dot(ac, ap);
+  if (d1 <= 0 && d2 <= 0) return a;
+
+  Vector3D bp = p - b;
+  double d3 = dot(ab, bp), d4 = dot(ac, bp);
+  if (d3 >= 0 && d4 <= d3) return b;
+
+  double vc = d1*d4 - d3*d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + d1/(d1 - d3)*ab;
+
+  Vector3D cp = p - c;
+  double d5 = dot(ab, cp), d6 = dot(ac, cp);
+  if (d6 >= 0 && d5 <= d6) return c;
+
+  double vb = d5*d2 - d1*d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + d2/(d2 - d6)*ac;
+
+  double va = d3*d6 - d5*d4;
+  if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) {
+    return b + (d4 - d3)/((d4 - d3) + (d5 - d6))*(c - b);
+  }
+
+  double denom = 1/(va + vb + vc);
+  return a + ab*(vb*denom) + ac*(vc*denom);
+}
+
+SDFCollider::SDFCollider(const vector<Vector3D> &vertices, const vector<uint32_t> &indices,
+                         int resolution, int band_cells, double friction)
+    : friction(friction), shape(MESH) {
+  // The flood fill below needs the distances out to half a cell
+  band_cells = max(band_cells, 1);
+  Vector3D lo(DBL_MAX, DBL_MAX, DBL_MAX), hi(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+  for (const Vector3D &v : vertices) {
+    for (int axis = 0; axis < 3; axis++) {
+      lo[axis] = min(lo[axis], v[axis]);
+      hi[axis] = max(hi[axis], v[axis]);
+    }
+  }
+  init_grid(lo, hi, resolution, band_cells + 1);
+  double band = band_cells*cell;
+  closest.assign(distance.size(), -1);
+
+  // Unsigned distance to the nearest triangle within the band, and which
+  // side of that triangle's plane the node is on. Where two triangles are
+  // equally near, at an edge or a vertex, the one the node lies more
+  // squarely in front of decides the side.
+  vector<float> alignment(distance.size(), 0);
+  vector<int8_t> side(distance.size(), 0);
+  for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+    const Vector3D &a = vertices[indices[t]];
+    const Vector3D &b = vertices[indices[t + 1]];
+    const Vector3D &c = vertices[indices[t + 2]];
+    Vector3D normal = cross(b - a, c - a);
+    if (normal.norm() == 0) continue;
+    normal.normalize();
+    int32_t id = triangles.size()/3;
+    triangles.push_back(a);
+    triangles.push_back(b);
+    triangles.push_back(c);
+
+    int from[3], to[3];
+    for (int axis = 0; axis < 3; axis++) {
+      double t_lo = min(a[axis], min(b[axis], c[axis])) - band;
+      double t_hi = max(a[axis], max(b[axis], c[axis])) + band;
+      from[axis] = max(0, (int) floor((t_lo - grid_min[axis])/cell));
+      to[axis] = min(dims[axis] - 1, (int) ceil((t_hi - grid_min[axis])/cell));
+    }
+    for (int z = from[2]; z <= to[2]; z++) {
+      for (int y = from[1]; y <= to[1]; y++) {
+        for (int x = from[0]; x <= to[0]; x++) {
+          Vector3D p = node_position(x, y, z);
+          Vector3D q = closest_on_triangle(p, a, b, c);
+          double d = (p - q).norm();
+          if (d > band) continue;
+          size_t k = node(x, y, z);
+          double along = dot(p - q, normal);
+          double tie = 1e-6*cell;
+          if (d < distance[k] - tie || (d <= distance[k] + tie && fabs(along) > alignment[k])) {
+            distance[k] = d;
+            closest[k] = id;
+            alignment[k] = fabs(along);
+            side[k] = along >= 0 ? 1 : -1;
+          }
+        }
+      }
+    }
+  }
+
+  // Inside and outside come from a flood fill rather than the triangles'
+  // winding: every edge between nodes on either side of the surface has an
+  // end within half a cell of it, so those nodes wall off the inside, and
+  // everything reachable from the grid border without crossing them is out
+  double wall = 0.5*cell*(1 + 1e-6);
+  vector<bool> outside(distance.size(), false);
+  vector<size_t> queue;
+  for (int z = 0; z < dims[2]; z++) {
+    for (int y = 0; y < dims[1]; y++) {
+      for (int x = 0; x < dims[0]; x++) {
+        bool border = x == 0 || y == 0 || z == 0 ||
+                      x == dims[0] - 1 || y == dims[1] - 1 || z == dims[2] - 1;
+        size_t k = node(x, y, z);
+        if (border && distance[k] > wall) {
+          outside[k] = true;
+          queue.push_back(k);
+        }
+      }
+    }
+  }
+  size_t plane = (size_t) dims[0]*dims[1];
+  while (!queue.empty()) {
+    size_t k = queue.back();
+    queue.pop_back();
+    int x = k % dims[0], y = (k/dims[0]) % dims[1], z = k/plane;
+    size_t next[6] = {x > 0 ? k - 1 : k, x < dims[0] - 1 ? k + 1 : k,
+                      y > 0 ? k - dims[0] : k, y < dims[1] - 1 ? k + dims[0] : k,
+                      z > 0 ? k - plane : k, z < dims[2] - 1 ? k + plane : k};
+    for (size_t j : next) {
+      if (!outside[j] && distance[j] > wall) {
+        outside[j] = true;
+        queue.push_back(j);
+      }
+    }
+  }
+
+  // Inside nodes past the band get the nearest triangle of a neighbor that
+  // has one, in sweeps along each diagonal direction (Bridson's
+  // makelevelset3), so the field points to the surface from anywhere inside
+  for (int dz = -1; dz <= 1; dz += 2) {
+    for (int dy = -1; dy <= 1; dy += 2) {
+      for (int dx = -1; dx <= 1; dx += 2) sweep(dx, dy, dz, outside);
+    }
+  }
+
+  // The wall nodes themselves take the side of their nearest triangle,
+  // flipped if most of the band says the mesh is wound inside out
+  long agree = 0;
+  for (size_t k = 0; k < distance.size(); k++) {
+    if (side[k] != 0 && distance[k] > wall) agree += (side[k] > 0) == outside[k] ? 1 : -1;
+  }
+  int8_t flip = agree < 0 ? -1 : 1;
+  winding = flip;
+  for (size_t k = 0; k < distance.size(); k++) {
+    double d = outside[k] ? min((double) distance[k], band) : distance[k];
+    if (distance[k] <= wall) {
+      distance[k] = flip*side[k] >= 0 ? d : -d;
+    } else {
+      distance[k] = outside[k] ? d : -d;
+    }
+  }
+
+  bake_gradients();
+}
+
+SDFCollider::SDFCollider(const Vector3D &center, double radius, double friction)
+    : friction(friction), shape(SPHERE), center(center), radius(radius) {}
+
+SDFCollider::SDFCollider(const Vector3D &box_min, const Vector3D &box_max, double friction)
+    : friction(friction), shape(BOX), center((box_min + box_max)/2), half((box_max - box_min)/2) {}
+
+void SDFCollider::init_grid(const Vector3D &lo, const Vector3D &hi, int resolution, int pad) {
+  Vector3D extent = hi - lo;
+  cell = max(extent.x, max(extent.y, extent.z))/max(resolution, 1);
+  grid_min = lo - Vector3D(pad*cell, pad*cell, pad*cell);
+  for (int axis = 0; axis < 3; axis++) {
+    dims[axis] = (int) ceil(extent[axis]/cell) + 2*pad + 1;
+  }
+  distance.assign((size_t) dims[0]*dims[1]*dims[2], FLT_MAX);
+}
+
+void SDFCollider::sweep(int dx, int dy, int dz, const vector<bool> &outside) {
+  int x0 = dx > 0 ? 1 : dims[0] - 2, x1 = dx > 0 ? dims[0] : -1;
+  int y0 = dy > 0 ? 1 : dims[1] - 2, y1 = dy > 0 ? dims[1] : -1;
+  int z0 = dz > 0 ? 1 : dims[2] - 2, z1 = dz > 0 ? dims[2] : -1;
+  for (int z = z0; z != z1; z += dz) {
+    for (int y = y0; y != y1; y += dy) {
+      for (int x = x0; x != x1; x += dx) {
+        size_t k = node(x, y, z);
+        if (outside[k]) continue;
+        Vector3D p = node_position(x, y, z);
+        // The seven neighbors already visited in this sweep
+        for (int from = 1; from < 8; from++) {
+          int32_t t = closest[node(x - (from & 1 ? dx : 0), y - (from & 2 ? dy : 0),
+                                   z - (from & 4 ? dz : 0))];
+          if (t < 0 || t == closest[k]) continue;
+          double d = (p - closest_on_triangle(p, triangles[3*t], triangles[3*t + 1],
+                                              triangles[3*t + 2])).norm();
+          if (d < distance[k]) {
+            distance[k] = d;
+            closest[k] = t;
+          }
+        }
+      }
+    }
+  }
+}
+
+void SDFCollider::bake_gradients() {
+  // Central differences, one-sided at the grid border
+  gradient.resize(3*distance.size());
+  for (int z = 0; z < dims[2]; z++) {
+    for (int y = 0; y < dims[1]; y++) {
+      for (int x = 0; x < dims[0]; x++) {
+        int at[3] = {x, y, z};
+        for (int axis = 0; axis < 3; axis++) {
+          int lo[3] = {x, y, z}, hi[3] = {x, y, z};
+          lo[axis] = max(at[axis] - 1, 0);
+          hi[axis] = min(at[axis] + 1, dims[axis] - 1);
+          double d_lo = distance[node(lo[0], lo[1], lo[2])];
+          double d_hi = distance[node(hi[0], hi[1], hi[2])];
+          int span = hi[axis] - lo[axis];
+          gradient[3*node(x, y, z) + axis] = span > 0 ? (d_hi - d_lo)/(span*cell) : 0;
+        }
+      }
+    }
+  }
+}
+
+Vector3D SDFCollider::node_position(int x, int y, int z) const {
+  return grid_min + cell*Vector3D(x, y, z);
+}
+
+bool SDFCollider::bounds(Vector3D &lo, Vector3D &hi) const {
+  if (shape == SPHERE) {
+    lo = center - Vector3D(radius, radius, radius);
+    hi = center + Vector3D(radius, radius, radius);
+  } else if (shape == BOX) {
+    lo = center - half;
+    hi = center + half;
+  } else {
+    // Particles outside the grid are never looked up
+    lo = grid_min;
+    hi = grid_min + cell*Vector3D(dims[0] - 1, dims[1] - 1, dims[2] - 1);
+  }
+  return true;
+}
+
+bool SDFCollider::sample(const Vector3D &p, double &d, Vector3D &grad) const {
+  Vector3D g = (p - grid_min)/cell;
+  int base[3];
+  double f[3];
+  for (int axis = 0; axis < 3; axis++) {
+    double fl = floor(g[axis]);
+    if (fl < 0 || fl >= dims[axis] - 1) return false;
+    base[axis] = (int) fl;
+    f[axis] = g[axis] - fl;
+  }
+
+  // Trilinear distance and gradient from the 8 corners of the cell
+  d = 0;
+  grad = Vector3D();
+  for (int corner = 0; corner < 8; corner++) {
+    int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+    double w = (dx ? f[0] : 1 - f[0])*(dy ? f[1] : 1 - f[1])*(dz ? f[2] : 1 - f[2]);
+    size_t k = node(base[0] + dx, base[1] + dy, base[2] + dz);
+    d += w*distance[k];
+    grad += w*Vector3D(gradient[3*k], gradient[3*k + 1], gradient[3*k + 2]);
+  }
+  return true;
+}
+
+bool SDFCollider::project_mesh(Vector3D &p) const {
+  // Near edges and corners the interpolated gradient blends the faces, so
+  // one step along it can stop short of the surface; the point is sampled
+  // and projected again. Where the gradient falls well short of unit
+  // length, the corners of the cell disagree about the way out, and the
+  // nearest triangle decides instead. It also gets the last word, since
+  // within a cell of an edge the interpolated distance can read outside
+  // early.
+  bool moved = false;
+  for (int pass = 0; pass < MAX_PASSES; pass++) {
+    double d;
+    Vector3D grad;
+    if (!sample(p, d, grad) || d >= cell) return moved;
+    if (d >= 0) break;
+    double length = grad.norm();
+    if (length < MIN_GRADIENT) break;
+    p += grad/length*(SURFACE_OFFSET - d);
+    moved = true;
+  }
+  return project_to_triangle(p) || moved;
+}
+
+bool SDFCollider::project_to_triangle(Vector3D &p) const {
+  // The nearest of the triangles recorded at the corners of p's cell
+  Vector3D g = (p - grid_min)/cell;
+  int base[3];
+  for (int axis = 0; axis < 3; axis++) {
+    base[axis] = (int) floor(g[axis]);
+    if (base[axis] < 0 || base[axis] >= dims[axis] - 1) return false;
+  }
+  Vector3D q;
+  int32_t best = -1;
+  double best_d2 = DBL_MAX;
+  for (int corner = 0; corner < 8; corner++) {
+    int32_t t = closest[node(base[0] + (corner & 1), base[1] + ((corner >> 1) & 1),
+                             base[2] + (corner >> 2))];
+    if (t < 0) continue;
+    Vector3D on = closest_on_triangle(p, triangles[3*t], triangles[3*t + 1], triangles[3*t + 2]);
+    double d2 = (on - p).norm2();
+    if (d2 < best_d2) {
+      best_d2 = d2;
+      best = t;
+      q = on;
+    }
+  }
+  if (best < 0) return false;
+
+  // p is inside if it is behind that triangle; it leaves along the way to
+  // the surface, or along the outward normal when it is on it
+  const Vector3D &a = triangles[3*best];
+  Vector3D normal = winding*cross(triangles[3*best + 1] - a, triangles[3*best + 2] - a);
+  Vector3D out = q - p;
+  double behind = dot(out, normal);
+  if (behind < 0) return false;
+  if (out.norm() < SURFACE_OFFSET || behind == 0) out = normal;
+  p = q + out.unit()*SURFACE_OFFSET;
+  return true;
+}
+
+bool SDFCollider::project_sphere(Vector3D &p) const {
+  Vector3D d = p - center;
+  double length = d.norm();
+  if (length >= radius || length < 1e-12) return false;
+  p = center + d/length*(radius + SURFACE_OFFSET);
+  return true;
+}
+
+bool SDFCollider::project_box(Vector3D &p) const {
+  // Out through the nearest face
+  Vector3D q = p - center;
+  int axis = -1;
+  double depth = DBL_MAX;
+  for (int a = 0; a < 3; a++) {
+    double to_face = half[a] - fabs(q[a]);
+    if (to_face <= 0) return false;
+    if (to_face < depth) {
+      depth = to_face;
+      axis = a;
+    }
+  }
+  p[axis] = center[axis] + (q[axis] < 0 ? -1 : 1)*(half[axis] + SURFACE_OFFSET);
+  return true;
+}
+
+void SDFCollider::collide_particle(ParticleRef pm) {
+  // Friction applies once, to where the projection ends up
+  Vector3D surface_point = pm.x_star;
+  bool moved = shape == SPHERE ? project_sphere(surface_point)
+             : shape == BOX ? project_box(surface_point) : project_mesh(surface_point);
+  if (!moved) return;
+  pm.x_star = pm.origin + (surface_point - pm.origin)*(1 - friction);
+}
@@ -0,0 +1,82 @@
+#ifndef COLLISIONOBJECT_SDF_H
+#define COLLISIONOBJECT_SDF_H
+
+#include <cstdint>
+#include <vector>
+#include <nanogui/nanogui.h>
+
+#include "CGL/CGL.h"
+#include "CGL/vector3D.h"
+#include "collisionObject.h"
+#include "particle.h"
+
+using namespace nanogui;
+using namespace CGL;
+using namespace std;
+
+/*
+  Static obstacle baked into a signed distance grid at load time, negative
+  inside. Each grid node stores the distance and its gradient, so a
+  collision is a trilinear lookup at x_star: a particle found inside is
+  projected along the gradient onto the surface, with the same friction
+  rule as Plane. Meshes must be closed. Distances are exact within
+  band_cells cells of the surface; farther nodes inside take the nearest
+  triangle of a neighbor, so each of them has a distance and a direction
+  out, and farther nodes outside are clamped to the band. resolution is
+  the number of cells along the longest side of the mesh's bounding box.
+  Where the interpolated gradient blends faces, at edges and corners, the
+  projection is repeated a few times, and a particle still inside after
+  that leaves through its nearest triangle. The analytic sphere and box
+  need no grid and are projected exactly.
+*/
+struct SDFCollider : public CollisionObject {
+public:
+  // Closed triangle mesh, three vertex indices per triangle
+  SDFCollider(const vector<Vector3D> &vertices, const vector<uint32_t> &indices,
+              int resolution, int band_cells, double friction);
+  SDFCollider(const Vector3D &center, double radius, double friction);
+  SDFCollider(const Vector3D &box_min, const Vector3D &box_max, double friction);
+
+  void render(GLShader &shader) {}
+  void collide_particle(ParticleRef pm);
+  bool bounds(Vector3D &lo, Vector3D &hi) const;
+
+  double friction;
+
+private:
+  enum Shape { MESH, SPHERE, BOX };
+
+  // Sizes the grid to cover lo..hi plus a margin of pad cells
+  void init_grid(const Vector3D &lo, const Vector3D &hi, int resolution, int pad);
+  // One sweep of nearest-triangle propagation in direction (dx, dy, dz),
+  // over the nodes not marked outside
+  void sweep(int dx, int dy, int dz, const vector<bool> &outside);
+  void bake_gradients();
+  Vector3D node_position(int x, int y, int z) const;
+  // Trilinear distance and gradient at p, false outside the grid
+  bool sample(const Vector3D &p, double &d, Vector3D &grad) const;
+  // Moves p, if inside, just past the surface; false if it was outside
+  bool project_mesh(Vector3D &p) const;
+  // Moves p just past the nearest triangle recorded around it if p is
+  // behind that triangle; false if it was not moved
+  bool project_to_triangle(Vector3D &p) const;
+  bool project_sphere(Vector3D &p) const;
+  bool project_box(Vector3D &p) const;
+
+  Shape shape;
+  Vector3D center;   // of the sphere or box
+  double radius;
+  Vector3D half;     // half extents of the box
+  size_t node(int x, int y, int z) const { return ((size_t) z*dims[1] + y)*dims[0] + x; }
+
+  Vector3D grid_min;
+  double cell;
+  int dims[3];
+  vector<float> distance;
+  vector<float> gradient;  // three per node
+  vector<int32_t> closest; // nearest triangle of each node, -1 if none
+  vector<Vector3D> triangles;  // three corners per triangle
+  int8_t winding = 1;      // -1 if the mesh's normals point inwards
+};
+
+#endif /* COLLISIONOBJECT_SDF_H */
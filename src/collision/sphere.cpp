@@ -2,19 +2,19 @@
 
 #include "../misc/sphere_drawing.h"
 #include "sphere.h"
+#include "../particleStore.h"
 
 using namespace nanogui;
 using namespace CGL;
 
-void Sphere::collide(Particle &pm) {
-  // TODO (Part 3.1): Handle collisions with spheres.
-	Vector3D d = pm.origin - origin;
-	if (d.norm() <= radius) {
-		Vector3D d_normal = d / d.norm();
-		Vector3D tangent_p = origin + radius * d_normal;
-		Vector3D correction_vec = tangent_p - pm.last_origin;
-		pm.origin = pm.last_origin + (1.-friction)*correction_vec;
-	}
+void Sphere::collide_particle(ParticleRef pm) {
+  collide(pm.x_star, pm.origin);
+}
+
+void Sphere::collide_particles(ParticleStore &particles, size_t begin, size_t end) {
+  Vector3D *x_star = particles.x_star.data();
+  const Vector3D *last = particles.origin.data();
+  for (size_t i = begin; i < end; i++) collide(x_star[i], last[i]);
 }
 
 void Sphere::render(GLShader &shader) {
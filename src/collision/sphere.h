@@ -14,7 +14,25 @@ public:
         friction(friction) {}
 
   void render(GLShader &shader);
-  void collide(Particle &pm);
+  void collide_particle(ParticleRef pm);
+  void collide_particles(ParticleStore &particles, size_t begin, size_t end);
+
+  // A particle that ends up inside is moved out to the surface. One exactly
+  // at the center has no direction to leave in and is left for the next step
+  void collide(Vector3D &x_star, const Vector3D &last) const {
+    Vector3D d = x_star - origin;
+    if (d.norm2() > radius2) return;
+    double length = d.norm();
+    if (length < 1e-12) return;
+    Vector3D tangent_p = origin + radius * (d / length);
+    x_star = last + (1. - friction) * (tangent_p - last);
+  }
+
+  bool bounds(Vector3D &lo, Vector3D &hi) const {
+    lo = origin - Vector3D(radius, radius, radius);
+    hi = origin + Vector3D(radius, radius, radius);
+    return true;
+  }
 
 private:
   Vector3D origin;
@@ -23,7 +23,7 @@ using namespace CGL;
 //   return true;
 // }
 
-void Triangle::collide_particle(Particle &pm) {
+void Triangle::collide_particle(ParticleRef pm) {
 //   // TODO (Part 3.2): Handle collisions with planes.
 //   Vector3D point = this->plane->point;
 //   Vector3D normal = this->plane->normal;
@@ -6,6 +6,7 @@
 #include "collisionObject.h"
 #include "plane.h"
 #include "particle.h"
+#include "../particleStore.h"
 
 using namespace nanogui;
 using namespace CGL;
@@ -28,31 +29,47 @@ public:
 
   void render(GLShader &shader){};
 
-  void collide_particle(Particle &pm){
+  void collide_particle(ParticleRef pm){
+    collide(pm.x_star, pm.origin);
+  };
+
+  void collide_particles(ParticleStore &particles, size_t begin, size_t end){
+    for (size_t i = begin; i < end; i++) collide(particles.x_star[i], particles.origin[i]);
+  }
+
+  bool bounds(Vector3D &lo, Vector3D &hi) const {
+    for (int axis = 0; axis < 3; axis++) {
+      lo[axis] = min(a[axis], min(b[axis], c[axis]));
+      hi[axis] = max(a[axis], max(b[axis], c[axis]));
+    }
+    return true;
+  }
+
+  void collide(Vector3D &x_star, const Vector3D &origin){
     Vector3D point = this->plane->point;
     Vector3D normal = this->plane->normal;
-    float last_side = dot(point - pm.origin, normal);
-    float current_side = dot(point - pm.x_star, normal);
+    float last_side = dot(point - origin, normal);
+    float current_side = dot(point - x_star, normal);
 
     if ((last_side > 0) == (current_side > 0)) return;
 
     normal = (current_side > 0.0) ? normal : -normal;
     double t = current_side/dot(normal, normal);
-    Vector3D intersect_point = pm.x_star + t * normal;
+    Vector3D intersect_point = x_star + t * normal;
 
     if (!point_in_triangle(intersect_point)) return;
 
-    Vector3D correction_vector = intersect_point - pm.origin + normal * SURFACE_OFFSET;
-    pm.x_star = pm.origin + correction_vector * (1 - friction);
-  };
+    Vector3D correction_vector = intersect_point - origin + normal * SURFACE_OFFSET;
+    x_star = origin + correction_vector * (1 - friction);
+  }
 
   bool point_in_triangle(Vector3D pt){
-    std::vector<Vector3D> vertices = {a,b,c};
+    const Vector3D *vertices[3] = {&a, &b, &c};
     for (int i = 0; i < 3; i++) {
       int k = (i == 0)? 2 : i-1;
-      Vector3D diff = vertices[i] - vertices[k];
-      Vector3D center_diff = plane->point - vertices[k];
-      Vector3D particle_diff = pt - vertices[k];
+      Vector3D diff = *vertices[i] - *vertices[k];
+      Vector3D center_diff = plane->point - *vertices[k];
+      Vector3D particle_diff = pt - *vertices[k];
       if (CGL::dot(CGL::cross(particle_diff, diff), CGL::cross(center_diff, diff)) < 0) return false;
     }
     return true;
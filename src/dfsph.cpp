@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <iostream>
+
+#include "collision/container.h"
+#include "fluid.h"
+#include "solver.h"
+
+using namespace std;
+
+void DFSPHSolver::step(Fluid &fluid, double delta_t, vector<Vector3D> &external_accelerations,
+                       vector<CollisionObject *> *collision_objects, int frame) {
+  ParticleStore &particles = fluid.particles;
+  long n = fluid.num_active;
+
+  // Everything up to the position update works at the current positions
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) {
+    particles.last_origin[i] = particles.origin[i];
+    particles.x_star[i] = particles.origin[i];
+  }
+
+  const NeighborTable &neighbors = fluid.build_index();
+
+  // for surfacing only
+  if (fluid.export_voxels && frame >= 0) fluid.build_voxel_grid(frame);
+
+  compute_density_alpha(fluid);
+  stats.steps++;
+
+  // Divergence-free velocities from the end of the last step
+  if (fluid.divergence_solve) {
+    int iters = 0;
+    double error = update_source(fluid, delta_t, false)*delta_t/fluid.RHO_O;
+    while (iters < fluid.dfsph_max_iters && error > fluid.dfsph_divergence_tolerance) {
+      pressure_sweep(fluid, delta_t, 1/delta_t);
+      error = update_source(fluid, delta_t, false)*delta_t/fluid.RHO_O;
+      iters++;
+    }
+    stats.divergence_iterations += iters;
+    stats.divergence_error_sum += error;
+  }
+
+  // Non-pressure forces
+  fluid.update_omega(neighbors);
+  fluid.apply_vorticity(neighbors);
+  fluid.apply_viscosity(neighbors);
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) {
+    for (auto ea: external_accelerations){
+      particles.velocity[i] += delta_t*(ea+particles.forces[i]);
+    }
+  }
+
+  // Constant density at the end of the step
+  int iters = 0;
+  double error = update_source(fluid, delta_t, true)/fluid.RHO_O;
+  while (iters < fluid.dfsph_max_iters && error > fluid.dfsph_density_tolerance) {
+    pressure_sweep(fluid, delta_t, 1/(delta_t*delta_t));
+    error = update_source(fluid, delta_t, true)/fluid.RHO_O;
+    iters++;
+  }
+  stats.density_iterations += iters;
+  stats.density_error_sum += error;
+
+  // Colliders move x_star back, and the velocity follows what they did.
+  // The grid binned the particles at origin, and none moves farther than
+  // the fastest one.
+  double max_speed2 = 0;
+  #pragma omp parallel for schedule(static) reduction(max:max_speed2)
+  for (long i = 0; i < n; i++) max_speed2 = max(max_speed2, particles.velocity[i].norm2());
+  fluid.update_broad_phase(collision_objects, delta_t*sqrt(max_speed2));
+  const Container *container = fluid.begin_collisions(collision_objects);
+  #pragma omp parallel
+  {
+    long begin, end;
+    thread_block(n, begin, end);
+    for (long i = begin; i < end; i++) {
+      particles.x_star[i] = particles.origin[i] + delta_t*particles.velocity[i];
+      if (container != NULL) container->contain(particles.x_star[i], particles.origin[i]);
+    }
+    fluid.collide_block(collision_objects, container, begin, end);
+    for (long i = begin; i < end; i++) {
+      particles.velocity[i] = (particles.x_star[i]-particles.origin[i])/delta_t;
+    }
+  }
+}
+
+void DFSPHSolver::reset() {
+  if (stats.steps > 0) {
+    cout << "[Fluid] DFSPH: " << (double) stats.density_iterations/stats.steps << " density and "
+         << (double) stats.divergence_iterations/stats.steps << " divergence iterations per step, "
+         << "density error " << stats.density_error_sum/stats.steps << " avg, divergence error "
+         << stats.divergence_error_sum/stats.steps << " avg" << endl;
+  }
+  stats = DFSPHStats();
+}
+
+void DFSPHSolver::compute_density_alpha(Fluid &fluid) {
+  // Density and the DFSPH factor 1/(|sum_j m grad W_ij|^2 + sum_j |m grad W_ij|^2),
+  // caching m grad W_ij for the pressure sweeps
+  ParticleStore &particles = fluid.particles;
+  const NeighborTable &neighbors = fluid.neighbors;
+  long n = fluid.num_active;
+  alpha.resize(particles.size());
+  source.resize(particles.size());
+  // Sleeping particles never get a kappa and act as a static boundary
+  kappa.assign(particles.size(), 0);
+  grad_W.resize(neighbors.indices.size());
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) {
+    const Vector3D &pi = particles.x_star[i];
+    double rho = 0;
+    double grad2 = 0;
+    Vector3D grad;
+    for (uint32_t k = neighbors.offsets[i]; k < neighbors.offsets[i + 1]; k++) {
+      Vector3D r = pi - particles.x_star[neighbors.indices[k]];
+      double r2 = r.norm2();
+      rho += fluid.mass*fluid.kernel.W(r2);
+      grad_W[k] = fluid.mass*fluid.kernel.grad_scale(r2)*r;
+      grad += grad_W[k];
+      grad2 += grad_W[k].norm2();
+    }
+    particles.density[i] = rho;
+    double denom = grad.norm2() + grad2;
+    alpha[i] = denom > 1e-6 ? 1/denom : 0;
+  }
+}
+
+double DFSPHSolver::update_source(Fluid &fluid, double delta_t, bool predict) {
+  // Only compression is corrected, so particles at the surface are not
+  // pulled together
+  ParticleStore &particles = fluid.particles;
+  const NeighborTable &neighbors = fluid.neighbors;
+  long n = fluid.num_active;
+  double sum = 0;
+
+  #pragma omp parallel for schedule(static) reduction(+:sum)
+  for (long i = 0; i < n; i++) {
+    const Vector3D &vi = particles.velocity[i];
+    double rate = 0;
+    for (uint32_t k = neighbors.offsets[i]; k < neighbors.offsets[i + 1]; k++) {
+      rate += dot(vi - particles.velocity[neighbors.indices[k]], grad_W[k]);
+    }
+    double s = predict ? particles.density[i] + delta_t*rate - fluid.RHO_O : rate;
+    source[i] = max(s, 0.0);
+    sum += source[i];
+  }
+  return n > 0 ? sum/n : 0;
+}
+
+void DFSPHSolver::pressure_sweep(Fluid &fluid, double delta_t, double scale) {
+  // Jacobi: every kappa comes from the source before any velocity changes
+  ParticleStore &particles = fluid.particles;
+  const NeighborTable &neighbors = fluid.neighbors;
+  long n = fluid.num_active;
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) kappa[i] = source[i]*alpha[i]*scale;
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) {
+    Vector3D dv;
+    for (uint32_t k = neighbors.offsets[i]; k < neighbors.offsets[i + 1]; k++) {
+      dv += (kappa[i] + kappa[neighbors.indices[k]])*grad_W[k];
+    }
+    particles.velocity[i] -= delta_t*dv;
+  }
+}
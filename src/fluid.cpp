@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -6,6 +7,7 @@
 #include <vector>
 
 #include "fluid.h"
+#include "collision/container.h"
 #include "collision/plane.h"
 #include "collision/particle.h"
 #include "float.h"
@@ -31,6 +33,15 @@ Fluid::Fluid(double width, double length, double height, double particle_radius,
 }
 
 Fluid::~Fluid() {
+  print_neighbor_stats();
+  print_solver_stats();
+  print_step_stats();
+  print_sleep_stats();
+  print_broad_phase_stats();
+  if (solver != NULL) {
+    solver->reset();
+    delete solver;
+  }
   particles.clear();
 }
 
@@ -38,6 +49,10 @@ void Fluid::buildGrid() {
   double w_offset = 0.1;
   double l_offset = 0.1;
   double h_offset = 0.1;
+  init_kernel();
+  init_solver();
+  particles.radius = radius;
+  particles.friction = friction;
   width = 0.1 * num_width_points;
   height = 0.1 * num_height_points;
   length = 0.1 * num_length_points;
@@ -54,8 +69,7 @@ void Fluid::buildGrid() {
                                   zcenter + (j * l_offset),
                                   minBoundaries[2]+1 + (k * h_offset + 0.01));
           // cout << pos << endl;
-          Particle p = Particle(pos, radius, friction);
-          particles.emplace_back(p);
+          particles.add(pos, Vector3D(0,0,0));
         }
       }
     }
@@ -67,8 +81,7 @@ void Fluid::buildGrid() {
                         zcenter + (j * l_offset),
                         maxBoundaries[2]-1 - (k * h_offset + 0.01));
           // cout << pos << endl;
-          Particle p = Particle(pos, radius, friction);
-          particles.emplace_back(p);
+          particles.add(pos, Vector3D(0,0,0));
         }
       }
     }
@@ -88,25 +101,26 @@ void Fluid::buildGrid() {
           Vector3D pos = Vector3D(center[0] + (i- (num_width_points/2.0)) * w_offset,
                                   j * l_offset,
                                   (center[2] + (k - (num_height_points/2.0)) * h_offset));
-          Particle p = Particle(pos, radius, friction);
-          p.velocity = Vector3D(0,-5,0);
-          particles.emplace_back(p);
+          particles.add(pos, Vector3D(0,-5,0));
         }
       }
     }
   }
+  num_active = particles.size();
 }
 
 GLfloat* Fluid::getBuffer() {
     GLfloat* data = (GLfloat*) malloc(sizeof(GLfloat)*this->particles.size()*7);
     int count = 0;
-    for (auto particle : particles) {
-        data[count * 7] = particle.origin.x;
-        data[count * 7+1] = particle.origin.y;
-        data[count * 7+2] = particle.origin.z;
-        data[count * 7+3] = particle.color.x;
-        data[count * 7+4] = particle.color.y;
-        data[count * 7+5] = particle.color.z;
+    for (size_t i = 0; i < particles.size(); i++) {
+        const Vector3D &origin = particles.origin[i];
+        const Vector3D &color = particles.color[i];
+        data[count * 7] = origin.x;
+        data[count * 7+1] = origin.y;
+        data[count * 7+2] = origin.z;
+        data[count * 7+3] = color.x;
+        data[count * 7+4] = color.y;
+        data[count * 7+5] = color.z;
         // data[count * 7+3] = particle.origin.x * particle.origin.x;
         // data[count * 7+4] = 1.0f;
         // data[count * 7+5] = particle.origin.z * particle.origin.z;
@@ -183,22 +197,24 @@ void Fluid::convertVoxelToFaces(Vector3D min, Vector3D sizeCell){
 void Fluid::saveVoxelToCSV(std::string frameNum, Vector3D min, Vector3D sizeCell) {
   ofstream fs;
   fs.open("../mitsuba/input/csv" + frameNum + ".csv", std::ios_base::app);
+
+  // Query one x slab of voxels at a time through the batched search
+  std::vector<Vector3D> slab;
+  NeighborTable matches;
   for (int xpos = 0; xpos < num_cells.x; ++xpos) {
+    slab.clear();
     for (int ypos = 0; ypos < num_cells.y; ++ypos) {
       for (int zpos = 0; zpos < num_cells.z; ++zpos) {
-        // fs << xpos << " " << ypos <<" " << zpos/
-        fs << isotropic_kernel(Vector3D(xpos, ypos, zpos)*sizeCell + min) << std::endl;
-        // fs << gradientNormal(Vector3D(xpos, ypos, zpos)*sizeCell + min) << std::endl;
-        // fs << isotropic_kernel(Vector3D(xpos+1, ypos, zpos)*sizeCell+ min);
-        // fs << isotropic_kernel(Vector3D(xpos+1, ypos, zpos+1)*sizeCell+ min);
-        // fs << isotropic_kernel(Vector3D(xpos, ypos, zpos+1)*sizeCell+ min);
-        // fs << isotropic_kernel(Vector3D(xpos, ypos+1, zpos)*sizeCell+ min);
-        // fs << isotropic_kernel(Vector3D(xpos+1, ypos+1, zpos)*sizeCell+ min);
-        // fs << isotropic_kernel(Vector3D(xpos+1, ypos+1, zpos+1)*sizeCell+ min);
-        // fs << isotropic_kernel(Vector3D(xpos, ypos+1, zpos+1)*sizeCell+ min);
-        // fs << std::endl;
+        slab.push_back(Vector3D(xpos, ypos, zpos)*sizeCell + min);
       }
     }
+    radius_search_batch(slab, R, matches);
+
+    for (size_t v = 0; v < slab.size(); v++) {
+      double value = 0;
+      for (uint32_t j : matches[v]) value += W(slab[v]-particles.x_star[j]);
+      fs << value << std::endl;
+    }
   }
   fs.close();
 }
@@ -302,44 +318,174 @@ void Fluid::saveVoxelsToMitsuba(std::string fileName, Vector3D min, Vector3D max
 void Fluid::simulate(double frames_per_sec, double simulation_steps, FluidParameters *fp,
                      vector<Vector3D> external_accelerations,
                       vector<CollisionObject *> *collision_objects, int step) {
-  double delta_t = 1.0f / fps / simulation_steps;
-  for (auto &p: particles) {
-    p.last_origin = p.origin;
-    for (auto ea: external_accelerations){
-      p.velocity += delta_t*(ea+p.forces);
+  advance(1.0 / frames_per_sec / simulation_steps, external_accelerations, collision_objects, step);
+}
+
+void Fluid::simulate_frame(double frames_per_sec, vector<Vector3D> external_accelerations,
+                           vector<CollisionObject *> *collision_objects, int frame) {
+  // Sub-cycles CFL-limited steps so the last one ends exactly on the frame
+  // boundary. A step that would leave less than itself for the next one is
+  // split in two halves instead of leaving a sliver.
+  double frame_dt = 1.0 / frames_per_sec;
+  double t = 0;
+  int steps = 0;
+  while (t < frame_dt) {
+    double delta_t = cfl_dt();
+    double remaining = frame_dt - t;
+    bool last = delta_t >= remaining;
+    if (last) {
+      delta_t = remaining;
+    } else if (2*delta_t > remaining) {
+      delta_t = 0.5*remaining;
     }
-    p.x_star = p.origin + delta_t*p.velocity;
+    // Voxels are exported once per frame, from its last step
+    advance(delta_t, external_accelerations, collision_objects, last ? frame : -1);
+    t = last ? frame_dt : t + delta_t;
+    steps++;
+
+    step_stats.min_dt = min(step_stats.min_dt, delta_t);
+    step_stats.max_dt = max(step_stats.max_dt, delta_t);
   }
+  step_stats.frames++;
+  step_stats.steps += steps;
+}
+
+double Fluid::cfl_dt() {
+  double max_v2 = 0;
+  #pragma omp parallel for schedule(static) reduction(max:max_v2)
+  for (long i = 0; i < (long) particles.size(); i++) max_v2 = max(max_v2, particles.velocity[i].norm2());
 
+  // No particle may cross more than cfl*R in one step
+  double delta_t = max_v2 > 0 ? cfl*R/sqrt(max_v2) : max_dt;
+  return max(min_dt, min(max_dt, delta_t));
+}
 
-  std::vector<std::vector<Particle *>>  neighborArray = build_index();
+void Fluid::print_step_stats() {
+  if (step_stats.frames == 0) return;
+  cout << "[Fluid] adaptive dt: " << (double) step_stats.steps/step_stats.frames
+       << " steps per frame, dt " << step_stats.min_dt << " to " << step_stats.max_dt
+       << " (bounds " << min_dt << ", " << max_dt << ", CFL " << cfl << ")" << endl;
+}
 
-  // for surfacing only
-  build_voxel_grid(step);
+uint32_t Fluid::sleep_cell(const Vector3D &x) {
+  int c[3];
+  for (int a = 0; a < 3; a++) {
+    c[a] = (int) floor((x[a] - minBoundaries[a])/R);
+    c[a] = max(0, min(sleep_dims[a] - 1, c[a]));
+  }
+  return c[0] + sleep_dims[0]*(c[1] + sleep_dims[1]*c[2]);
+}
 
-  for(int iter=0; iter<solver_iters; iter++) {
-    this->update_lambdas(neighborArray);
-    this->update_delta_p(neighborArray);
-    //apply delta_p and perform collision detection
-    for (Particle &p: this->particles) {
-      p.x_star += p.delta_p*sf;
+void Fluid::update_sleeping() {
+  if (sleep_cells.empty()) {
+    for (int a = 0; a < 3; a++) {
+      sleep_dims[a] = max(1, (int) ceil((maxBoundaries[a] - minBoundaries[a])/R));
     }
-    for (Particle &p: this->particles) {
-      for (CollisionObject *co : *collision_objects) co->collide_particle(p);
+    sleep_cells.resize((size_t) sleep_dims[0]*sleep_dims[1]*sleep_dims[2]);
+  }
+  if (sleep_density.size() != particles.size()) sleep_density = particles.density;
+
+  // Bin the awake particles; a cell is loud this step if any of them moves
+  // faster than sleep_velocity or had its density error change by more than
+  // sleep_density_error. A settled pool can rest well off the rest density,
+  // so the error itself says little.
+  uint32_t step = steps_taken;
+  double v2 = sleep_velocity*sleep_velocity;
+  bool changed = false;
+  touched_cells.clear();
+  for (size_t i = 0; i < num_active; i++) {
+    uint32_t key = sleep_cell(particles.x_star[i]);
+    SleepCell &c = sleep_cells[key];
+    if (c.seen != step) {
+      c.seen = step;
+      c.loud = false;
+      touched_cells.push_back(key);
     }
+    double d_error = fabs(particles.density[i] - sleep_density[i])/RHO_O;
+    if (particles.velocity[i].norm2() > v2 || d_error > sleep_density_error) c.loud = true;
+    sleep_density[i] = particles.density[i];
   }
-  for (Particle &p: this->particles) {
-    p.velocity = (p.x_star-p.origin)/delta_t;
+
+  // A loud cell keeps its neighbors awake and wakes any that sleep
+  int nx = sleep_dims[0], ny = sleep_dims[1], nz = sleep_dims[2];
+  for (uint32_t key : touched_cells) {
+    SleepCell &c = sleep_cells[key];
+    c.quiet = c.loud ? 0 : c.quiet + 1;
+    if (!c.loud) continue;
+    int x = key % nx, y = (key/nx) % ny, z = key/(nx*ny);
+    for (int cz = max(0, z - 1); cz <= min(nz - 1, z + 1); cz++) {
+      for (int cy = max(0, y - 1); cy <= min(ny - 1, y + 1); cy++) {
+        for (int cx = max(0, x - 1); cx <= min(nx - 1, x + 1); cx++) {
+          SleepCell &nb = sleep_cells[cx + nx*(cy + ny*cz)];
+          nb.near_loud = step;
+          if (nb.asleep) {
+            nb.asleep = false;
+            nb.quiet = 0;
+            sleep_stats.wakes++;
+            changed = true;
+          }
+        }
+      }
+    }
+  }
+
+  for (uint32_t key : touched_cells) {
+    SleepCell &c = sleep_cells[key];
+    if (c.asleep) {
+      // A quiet particle drifted into a sleeping cell and is frozen with it
+      changed = true;
+    } else if (c.quiet >= sleep_steps && c.near_loud != step) {
+      c.asleep = true;
+      sleep_stats.sleeps++;
+      changed = true;
+    }
+  }
+
+  if (changed) {
+    // Stable partition into awake particles followed by sleeping ones. The
+    // neighbor lists are rebuilt, since woken particles have none.
+    vector<uint32_t> order, asleep;
+    order.reserve(particles.size());
+    for (size_t i = 0; i < particles.size(); i++) {
+      if (sleep_cells[sleep_cell(particles.x_star[i])].asleep) {
+        asleep.push_back(i);
+      } else {
+        order.push_back(i);
+      }
+    }
+    neighbors.clear();
+    num_active = order.size();
+    order.insert(order.end(), asleep.begin(), asleep.end());
+    permute_particles(order);
+    for (size_t i = num_active; i < particles.size(); i++) particles.velocity[i] = Vector3D();
   }
 
-  this->update_omega(neighborArray);
-  this->apply_vorticity(neighborArray);
-  this->apply_viscosity(neighborArray);
+  sleep_stats.steps++;
+  sleep_stats.awake += num_active;
+  sleep_stats.min_awake = min(sleep_stats.min_awake, num_active);
+}
+
+void Fluid::print_sleep_stats() {
+  if (sleep_stats.steps == 0) return;
+  cout << "[Fluid] sleeping: " << 100.0*sleep_stats.awake/sleep_stats.steps/particles.size()
+       << "% of particles awake on average, " << sleep_stats.min_awake << " fewest, "
+       << sleep_stats.sleeps << " cells fell asleep, " << sleep_stats.wakes << " woke" << endl;
+}
 
-double max_vort = -1;
-for (Particle &p: this->particles) max_vort = max(max_vort, p.omega.norm());
+void Fluid::advance(double delta_t, vector<Vector3D> &external_accelerations,
+                    vector<CollisionObject *> *collision_objects, int frame) {
+  if (!sleeping) num_active = particles.size();
+  if (reorder_interval > 0 && steps_taken % reorder_interval == 0) reorder_particles();
+  steps_taken++;
 
-for (Particle &p: this->particles) {
+  solver->step(*this, delta_t, external_accelerations, collision_objects, frame);
+
+  // Sleeping particles sit behind the awake ones and are left alone
+  long n = num_active;
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) {
+    ParticleRef p = particles[i];
     p.origin = p.x_star;
     //update color
     // p.color = Vector3D( neighborArray[i].size()/10 , 1, 1);
@@ -347,10 +493,12 @@ for (Particle &p: this->particles) {
 
     // p.color = Vector3D(0.05,5*(p.origin.y+0.2)*(p.origin.y+0.2), 1.0);
     // cout << 0.001*p.omega.norm()/(1+abs(p.omega.norm())) << endl;
-    p.color = Vector3D(0.05, p.omega.norm()/max_vort , 1.0);
+    if (color_vorticity) p.color = Vector3D(0.05, max_omega > 0 ? p.omega.norm()/max_omega : 0, 1.0);
     // i++;
   }
 
+  if (sleeping) update_sleeping();
+
   // cout << "Frame" << endl;
   // int nidx = (int) rand()*1000.0/RAND_MAX;
   // for(int k = 0; k < neighborArray[nidx].size(); k++) neighborArray[nidx][k]->color = Vector3D( 1, 1, 1);
@@ -358,21 +506,334 @@ for (Particle &p: this->particles) {
 
 }
 
+void PBFSolver::step(Fluid &fluid, double delta_t, vector<Vector3D> &external_accelerations,
+                     vector<CollisionObject *> *collision_objects, int frame) {
+  ParticleStore &particles = fluid.particles;
+  long n = fluid.num_active;
+
+  double max_move2 = 0;
+  #pragma omp parallel for schedule(static) reduction(max:max_move2)
+  for (long i = 0; i < n; i++) {
+    particles.last_origin[i] = particles.origin[i];
+    for (auto ea: external_accelerations){
+      particles.velocity[i] += delta_t*(ea+particles.forces[i]);
+    }
+    particles.x_star[i] = particles.origin[i] + delta_t*particles.velocity[i];
+    max_move2 = max(max_move2, (particles.x_star[i] - particles.origin[i]).norm2());
+  }
+
+
+  const NeighborTable &neighbors = fluid.build_index();
+
+  // A particle starts between origin and its predicted x_star; R is headroom
+  // for the solver's corrections, which apply_delta_p checks against it
+  fluid.update_broad_phase(collision_objects, sqrt(max_move2) + fluid.R);
+
+  // for surfacing only
+  if (fluid.export_voxels && frame >= 0) fluid.build_voxel_grid(frame);
+
+  // Warm start: one correction from the previous step's lambdas before the
+  // first lambda sweep. Lambdas live in the particle store, so they follow
+  // reordering; on the first step after a reset there are none yet.
+  if (fluid.warm_start && fluid.steps_taken > 1) {
+    fluid.update_delta_p(neighbors, false);
+    fluid.apply_delta_p(collision_objects);
+  }
+
+  // Chebyshev weights follow omega_1 = 1, omega_2 = 2/(2 - rho^2) and
+  // omega_k+1 = 4/(4 - rho^2 omega_k) from the first accelerated iteration
+  bool accelerate = fluid.chebyshev;
+  double rho = fluid.chebyshev_rho;
+  double weight = 1;
+  double last_error = 0;
+  if (accelerate) {
+    previous.resize(particles.size());
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) previous[i] = particles.x_star[i];
+  }
+
+  int iters = fluid.solver_iters;
+  double residual = 0;
+  for(int iter=0; iter<fluid.solver_iters; iter++) {
+    fluid.update_lambdas(neighbors);
+    // update_lambdas just evaluated the density at the current x_star
+    if (fluid.density_tolerance > 0) {
+      residual = fluid.tolerance_on_max ? fluid.max_density_error() : fluid.mean_density_error();
+      if (iter >= fluid.min_solver_iters && residual < fluid.density_tolerance) {
+        iters = iter;
+        break;
+      }
+    }
+    if (accelerate) {
+      bool have_mean = fluid.density_tolerance > 0 && !fluid.tolerance_on_max;
+      double error = have_mean ? residual : fluid.mean_density_error();
+      if (iter < fluid.chebyshev_delay) {
+        // Plain Jacobi shrinks the error by about rho per iteration
+        if (fluid.chebyshev_rho <= 0 && iter > 0 && last_error > 0) {
+          rho = min(error/last_error, 0.99);
+        }
+      } else if (error > last_error) {
+        accelerate = false;
+        weight = 1;
+        stats.fallbacks++;
+      } else {
+        if (iter == fluid.chebyshev_delay) {
+          stats.steps++;
+          stats.rho_sum += rho;
+        }
+        weight = iter == fluid.chebyshev_delay ? 2/(2 - rho*rho) : 4/(4 - rho*rho*weight);
+        stats.accelerated++;
+      }
+      last_error = error;
+    }
+    fluid.update_delta_p(neighbors);
+    fluid.apply_delta_p(collision_objects, weight, accelerate ? &previous : NULL);
+  }
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) {
+    particles.velocity[i] = (particles.x_star[i]-particles.origin[i])/delta_t;
+  }
+
+  if (fluid.density_tolerance > 0) {
+    fluid.solver_stats.steps++;
+    fluid.solver_stats.iterations += iters;
+    if (iters == fluid.solver_iters) fluid.solver_stats.capped++;
+    fluid.solver_stats.residual_sum += residual;
+    fluid.solver_stats.max_residual = max(fluid.solver_stats.max_residual, residual);
+    if (fluid.log_solver) {
+      cout << "[Fluid] step " << fluid.steps_taken << ": " << iters << " solver iterations, density error "
+           << residual << (iters == fluid.solver_iters ? " (capped)" : "") << endl;
+    }
+  }
+
+  fluid.update_omega(neighbors);
+  fluid.apply_vorticity(neighbors);
+  fluid.apply_viscosity(neighbors);
+}
+
+void PBFSolver::reset() {
+  if (stats.steps > 0) {
+    cout << "[Fluid] Chebyshev: " << stats.steps << " steps accelerated for "
+         << (double) stats.accelerated/stats.steps << " iterations each, spectral radius "
+         << stats.rho_sum/stats.steps << " avg, " << stats.fallbacks << " fell back to Jacobi" << endl;
+  }
+  stats = ChebyshevStats();
+}
+
+void Fluid::apply_delta_p(vector<CollisionObject *> *collision_objects, double weight,
+                          vector<Vector3D> *previous) {
+  //apply delta_p and perform collision detection
+  // each thread hands its whole block to every collider in one call; a
+  // container is applied right as each particle moves
+  const Container *container = begin_collisions(collision_objects);
+  double reach2 = broad_phase_reach*broad_phase_reach;
+  double moved2 = 0;
+  #pragma omp parallel
+  {
+    long begin, end;
+    thread_block(num_active, begin, end);
+    double local_moved2 = 0;
+    for (long i = begin; i < end; i++) {
+      if (previous != NULL) {
+        Vector3D &prev = (*previous)[i];
+        Vector3D current = particles.x_star[i];
+        particles.x_star[i] = prev + weight*(current + particles.delta_p[i]*sf - prev);
+        prev = current;
+      } else {
+        particles.x_star[i] += particles.delta_p[i]*sf;
+      }
+      if (container != NULL) container->contain(particles.x_star[i], particles.origin[i]);
+      if (broad_phase_culling) {
+        local_moved2 = max(local_moved2, (particles.x_star[i] - broad_phase_positions[i]).norm2());
+      }
+    }
+    #pragma omp critical
+    moved2 = max(moved2, local_moved2);
+    #pragma omp barrier
+    // A particle carried past the broad phase's reach could miss an
+    // obstacle, so then every particle is tested in this pass
+    collide_block(collision_objects, container, begin, end, moved2 <= reach2);
+  }
+  if (broad_phase_culling && moved2 > reach2) {
+    broad_phase_stats.fallbacks++;
+    broad_phase_stats.tests += collider_candidates - collider_tests;
+  }
+}
+
+void Fluid::update_broad_phase(vector<CollisionObject *> *collision_objects, double reach) {
+  size_t num_objects = collision_objects->size();
+  collider_particles.resize(num_objects);
+  collider_culled.assign(num_objects, false);
+  collider_tests = 0;
+  collider_candidates = 0;
+  broad_phase_culling = false;
+  broad_phase_reach = reach;
+  broad_phase_stats.steps++;
+
+  // The grid binned the particles up to index_slack away from x_star
+  bool use_grid = neighbor_search == UNIFORM_GRID && grid.keys.size() == particles.size();
+  double grow = reach + (use_grid ? index_slack : 0);
+  for (size_t c = 0; c < num_objects; c++) {
+    Vector3D lo, hi;
+    if (!(*collision_objects)[c]->bounds(lo, hi)) continue;
+    collider_candidates += num_active;
+    if (!broad_phase) {
+      collider_tests += num_active;
+      continue;
+    }
+    lo -= Vector3D(grow, grow, grow);
+    hi += Vector3D(grow, grow, grow);
+
+    vector<uint32_t> &list = collider_particles[c];
+    list.clear();
+    if (use_grid) {
+      // Particles outside the grid sit in its border cells, and so do the
+      // parts of the box beyond it
+      int from[3], to[3];
+      for (int axis = 0; axis < 3; axis++) {
+        from[axis] = grid.cell_coord(lo[axis], axis);
+        to[axis] = grid.cell_coord(hi[axis], axis);
+      }
+      broad_phase_stats.cells += (size_t) (to[0] - from[0] + 1)*(to[1] - from[1] + 1)*(to[2] - from[2] + 1);
+      for (int z = from[2]; z <= to[2]; z++) {
+        for (int y = from[1]; y <= to[1]; y++) {
+          size_t row = grid.cell_key(0, y, z);
+          for (size_t k = grid.cell_start[row + from[0]]; k < grid.cell_start[row + to[0] + 1]; k++) {
+            uint32_t j = grid.sorted[k];
+            // Sleeping particles are not collided
+            if (j < num_active) list.push_back(j);
+          }
+        }
+      }
+      sort(list.begin(), list.end());
+    } else {
+      for (size_t i = 0; i < num_active; i++) {
+        const Vector3D &x = particles.x_star[i];
+        if (x.x >= lo.x && x.y >= lo.y && x.z >= lo.z && x.x <= hi.x && x.y <= hi.y && x.z <= hi.z) {
+          list.push_back(i);
+        }
+      }
+    }
+    collider_culled[c] = true;
+    broad_phase_culling = true;
+    collider_tests += list.size();
+  }
+
+  if (broad_phase_culling) {
+    broad_phase_positions.resize(num_active);
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < (long) num_active; i++) broad_phase_positions[i] = particles.x_star[i];
+  }
+}
+
+const Container *Fluid::begin_collisions(vector<CollisionObject *> *collision_objects) {
+  broad_phase_stats.tests += collider_tests;
+  broad_phase_stats.candidates += collider_candidates;
+  return Container::find(collision_objects);
+}
+
+void Fluid::collide_block(vector<CollisionObject *> *collision_objects, const Container *container,
+                          long begin, long end, bool cull) {
+  for (size_t c = 0; c < collision_objects->size(); c++) {
+    CollisionObject *co = (*collision_objects)[c];
+    if (co == container) continue;
+    if (cull && c < collider_culled.size() && collider_culled[c]) {
+      // The block's share of the particles the broad phase kept
+      const vector<uint32_t> &list = collider_particles[c];
+      auto first = lower_bound(list.begin(), list.end(), (uint32_t) begin);
+      auto last = lower_bound(first, list.end(), (uint32_t) end);
+      if (first != last) co->collide_indexed(particles, &*first, last - first);
+    } else {
+      co->collide_particles(particles, begin, end);
+    }
+  }
+}
+
+void Fluid::print_broad_phase_stats() {
+  if (broad_phase_stats.candidates == 0) return;
+  cout << "[Fluid] broad phase " << (broad_phase ? "on" : "off") << ": " << broad_phase_stats.tests
+       << " of " << broad_phase_stats.candidates << " obstacle collision tests run ("
+       << 100.0*broad_phase_stats.tests/broad_phase_stats.candidates << "%), "
+       << (double) broad_phase_stats.cells/broad_phase_stats.steps << " grid cells tagged per step, "
+       << broad_phase_stats.fallbacks << " collision passes moved past the reach and tested every particle"
+       << endl;
+}
+
+void Fluid::reorder_particles() {
+  // Only the awake prefix is sorted; sleeping particles keep their slots
+  Vector3D lo(DBL_MAX, DBL_MAX, DBL_MAX);
+  for (size_t i = 0; i < num_active; i++) {
+    const Vector3D &origin = particles.origin[i];
+    lo.x = min(lo.x, origin.x);
+    lo.y = min(lo.y, origin.y);
+    lo.z = min(lo.z, origin.z);
+  }
+
+  std::vector<std::pair<uint64_t, uint32_t>> codes(num_active);
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < (long) num_active; i++) {
+    Vector3D cell = (particles.origin[i] - lo) / R;
+    codes[i] = std::make_pair(morton_code((uint32_t) cell.x, (uint32_t) cell.y, (uint32_t) cell.z), i);
+  }
+  std::sort(codes.begin(), codes.end());
+
+  std::vector<uint32_t> order(particles.size());
+  for (size_t i = 0; i < particles.size(); i++) order[i] = i < num_active ? codes[i].second : i;
+  permute_particles(order);
+}
+
+void Fluid::permute_particles(const vector<uint32_t> &order) {
+  // order[i] is the old index of the particle that moves to slot i
+  size_t n = particles.size();
+  std::vector<uint32_t> new_index(n);
+  for (size_t i = 0; i < n; i++) new_index[order[i]] = i;
+
+  particles.permute(order);
+
+  // Every structure that refers to particles by index follows them; the
+  // table only has lists for the awake prefix, which order keeps in place
+  if (neighbors.size() == num_active) neighbors.permute(order, new_index);
+  if (build_positions.size() == n) ParticleStore::permute_array(build_positions, order);
+  if (sleep_density.size() == n) ParticleStore::permute_array(sleep_density, order);
+  if (grid.keys.size() == n) grid.permute(order, new_index);
+  if (tree != NULL && cloud.count == n) {
+    cloud.pts = particles.x_star.data();
+    for (auto &j : tree->vind) j = new_index[j];
+  }
+}
+
 ///////////////////////////////////////////////////////
 /// YOU DO NOT NEED TO REFER TO ANY CODE BELOW THIS ///
 ///////////////////////////////////////////////////////
 
 void Fluid::reset() {
-  Particle *pm = &particles[0];
-  for (int i = 0; i < particles.size(); i++) {
-    pm->origin = pm->start_origin;
-    pm->last_origin = pm->start_origin;
-    pm->forces *= 0;
-    pm->x_star = pm->origin;
-    pm->omega *= 0;
-    pm->delta_p *= 0;
-    pm->velocity *= 0;
-    pm++;
+  print_neighbor_stats();
+  print_solver_stats();
+  print_step_stats();
+  print_sleep_stats();
+  print_broad_phase_stats();
+  if (solver != NULL) solver->reset();
+  neighbor_stats = NeighborStats();
+  solver_stats = SolverStats();
+  step_stats = StepStats();
+  sleep_stats = SleepStats();
+  broad_phase_stats = BroadPhaseStats();
+  neighbors.clear();
+  steps_taken = 0;
+  sleep_cells.clear();
+  num_active = particles.size();
+  sleep_density.clear();
+
+  for (size_t i = 0; i < particles.size(); i++) {
+    ParticleRef pm = particles[i];
+    pm.origin = pm.start_origin;
+    pm.last_origin = pm.start_origin;
+    pm.forces *= 0;
+    pm.x_star = pm.origin;
+    pm.omega *= 0;
+    pm.delta_p *= 0;
+    pm.velocity *= 0;
+    pm.lambda = 0;
   }
 }
 
@@ -380,63 +841,109 @@ void Fluid::reset() {
 * Simulation Physics Code
 */
 
+void Fluid::init_kernel() {
+  simd_isa = simd ? detect_simd() : SIMD_SCALAR;
+  kernel.init(kernel_type, R);
+  kernel_f.init(kernel_type, R);
+  // Float only pays off where it halves the gathers and doubles the lanes
+  if (single_precision && (simd_isa == SIMD_SCALAR || kernel.type != POLY6_SPIKY)) {
+    cout << "[Fluid] precision \"float\" needs the SIMD poly6_spiky sweeps, using double" << endl;
+    single_precision = false;
+  }
+  // s_corr compares against the kernel at |dq| = 0.02*R along each axis
+  double dq2 = 3*0.02*0.02*R*R;
+  scorr_inv_W = 1.0/kernel.W(dq2);
+  pair_cache.scorr_inv_W = scorr_inv_W;
+  pair_cache_f.scorr_inv_W = 1.0f/kernel_f.W(dq2);
+}
+
+void Fluid::init_solver() {
+  if (solver != NULL) delete solver;
+  if (solver_type == DFSPH_SOLVER) {
+    solver = new DFSPHSolver();
+    // At a fixed frame-rate dt it diverges instead of damping the error
+    if (!adaptive_dt) {
+      cout << "[Fluid] DFSPH needs adaptive_dt, turning it on" << endl;
+      adaptive_dt = true;
+    }
+  } else {
+    solver = new PBFSolver();
+  }
+}
+
 double Fluid::W(Vector3D r) { //density kernel
-  double r_norm = r.norm();
-  // std::cout << "norm " << r_norm << '\n';
-  if (r_norm > R) return 0;
-  // std::cout << "W CONSTANT " << W_CONSTANT << '\n';
-  // std::cout << "R " << R << '\n';
-  return pow(R*R-r_norm*r_norm, 3.0)*W_CONSTANT;
+  return kernel.W(r.norm2());
 }
 
 Vector3D Fluid::del_W(Vector3D r) { // gradient of density kernel
-  double r_norm = r.norm();
-  if (r_norm > R) return Vector3D(0.0,0.0,0.0); //TODO possibly return 0 is r_norm is small
-  return -r*pow(R-r_norm,2.0)*W_DEL_CONSTANT/(r_norm + 1e-6); //TODO this could be negated.
+  return kernel.grad_scale(r.norm2())*r;
+}
+
+double Fluid::s_corr(double w) {
+  return tensile_correction(w, scorr_inv_W);
 }
 
 
-double Fluid::C_i(Particle p){
-  return p.density/RHO_O - 1;
+double Fluid::C_i(size_t i){
+  return particles.density[i]/RHO_O - 1;
 }
 
-double Fluid::density(Particle p, std::vector<Particle *>  neighbors) {
-  Vector3D pi = p.x_star;
+double Fluid::mean_density_error() {
+  if (num_active == 0) return 0;
+  double error = 0;
+  #pragma omp parallel for schedule(static) reduction(+:error)
+  for (long i = 0; i < (long) num_active; i++) error += fabs(C_i(i));
+  return error/num_active;
+}
+
+double Fluid::max_density_error() {
+  double error = 0;
+  #pragma omp parallel for schedule(static) reduction(max:error)
+  for (long i = 0; i < (long) num_active; i++) error = max(error, fabs(C_i(i)));
+  return error;
+}
+
+double Fluid::density(size_t i, const NeighborTable &neighbors) {
+  const Vector3D &pi = particles.x_star[i];
   double r = 0;
-  // cout << neighbors.size() << endl;
-  for (Particle * &pj: neighbors) {
-    // std::cout << "W " << W(pi-pj->x_star) << '\n';
-    r += W(pi-pj->x_star);
+  for (uint32_t j : neighbors[i]) {
+    r += W(pi-particles.x_star[j]);
   }
-  p.density = r; //TODO maybe include mass?
+  particles.density[i] = r; //TODO maybe include mass?
   return r;
 }
 
 
-Vector3D Fluid::del_ci_j(Particle i, Particle k) {
-  Vector3D to_return =  -del_W(i.x_star-k.x_star)/RHO_O; //TODO: could be negated
+Vector3D Fluid::del_ci_j(size_t i, size_t k) {
+  Vector3D to_return =  -del_W(particles.x_star[i]-particles.x_star[k])/RHO_O; //TODO: could be negated
   return to_return;
 }
 
-Vector3D Fluid::del_ci_i(Particle i, std::vector<Particle *> neighbors) {
+Vector3D Fluid::del_ci_i(size_t i, const NeighborTable &neighbors) {
   Vector3D accum;
-  for (Particle * &j : neighbors) {
-    accum += del_W(i.x_star-j->x_star); //TODO: might be negated
+  for (uint32_t j : neighbors[i]) {
+    accum += del_W(particles.x_star[i]-particles.x_star[j]); //TODO: might be negated
   }
   Vector3D to_return = accum/RHO_O;
   // cout << "ii:" << to_return << endl;
   return to_return;
 }
 
-void Fluid::update_lambdas(std::vector<std::vector<Particle *>>  neighborArray) {
-  int i = 0;
-  //#pragma omp parallel for
-  for (Particle &p: this-> particles) {
+void Fluid::update_lambdas(const NeighborTable &neighbors) {
+  if (pair_traversal) {
+    update_lambdas_pairs(neighbors);
+    return;
+  }
+  if (fused_solver) {
+    update_lambdas_fused(neighbors);
+    return;
+  }
 
-    std::vector<Particle *> neighbors  = neighborArray[i];
-    // std::cout << neighbors.size() << '\n';
-    // std::cout << density(p, neighbors) << '\n';
-    double ci = density(p, neighbors)/RHO_O - 1.0;
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < (long) num_active; i++) {
+    const Vector3D &pi = particles.x_star[i];
+    // std::cout << density(i, neighbors) << '\n';
+    double ci = density(i, neighbors)/RHO_O - 1.0;
     // std::cout << ci << '\n';
     double sum_sq_norm;
 
@@ -444,92 +951,414 @@ void Fluid::update_lambdas(std::vector<std::vector<Particle *>>  neighborArray)
     Vector3D del_i(0.0,0.0,0.0);
     Vector3D del_temp(0.0,0.0,0.0);
 
-    for (Particle * &j: neighbors){
-      del_temp = del_W(p.x_star-j->x_star)/RHO_O;
+    for (uint32_t j : neighbors[i]) {
+      del_temp = del_W(pi-particles.x_star[j])/RHO_O;
       del_i += del_temp;
       del_j += del_temp.norm2();
     }
     sum_sq_norm = del_j + del_i.norm2();
     // std::cout << "divisor " << sum_sq_norm << '\n';
-    p.lambda = -ci/(sum_sq_norm+EPSILON);
-    // std::cout << "lambda " << p.lambda << '\n';
-    i++;
+    particles.lambda[i] = -ci/(sum_sq_norm+EPSILON);
+    // std::cout << "lambda " << particles.lambda[i] << '\n';
   }
 }
 
 
-void Fluid::update_delta_p(std::vector<std::vector<Particle *>> neighborArray){
-  int i = 0;
-  //#pragma omp parallel for
-  for (Particle &p: this->particles) {
-    Vector3D p_pred = p.x_star;
-    std::vector<Particle *> neighbors = neighborArray[i];
+void Fluid::update_delta_p(const NeighborTable &neighbors, bool use_pair_cache){
+  if (pair_traversal) {
+    update_delta_p_pairs(neighbors);
+    return;
+  }
+  if (fused_solver && use_pair_cache) {
+    update_delta_p_fused(neighbors);
+    return;
+  }
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < (long) num_active; i++) {
+    Vector3D p_pred = particles.x_star[i];
     Vector3D delta = Vector3D(0.0,0.0,0.0);
-    float l = p.lambda;
-    for (Particle * &pj: neighbors) {
-      float scorr = -0.001 * pow(W(p_pred-pj->x_star)/W(Vector3D(0.02, 0.02, 0.02)*R), 4.0);
-      Vector3D gradient = del_W(p_pred-pj->x_star);
-      delta += (l + pj->lambda+scorr) * gradient;
+    float l = particles.lambda[i];
+    for (uint32_t j : neighbors[i]) {
+      const Vector3D &pj = particles.x_star[j];
+      Vector3D r = p_pred-pj;
+      double scorr = s_corr(W(r));
+      Vector3D gradient = del_W(r);
+      delta += (l + particles.lambda[j]+scorr) * gradient;
     }
-    p.delta_p = delta / RHO_O;
-    i++;
+    particles.delta_p[i] = delta / RHO_O;
   }
 }
 
-void Fluid::apply_vorticity(std::vector<std::vector<Particle *>> neighborArray){
-  //#pragma omp parallel for
-  for (int i = 0; i < particles.size(); i++){
-    Particle &p = particles[i];
-    Vector3D N;
-
-    p.forces *= 0;
-    continue;
+void Fluid::apply_vorticity(const NeighborTable &neighbors){
+  long n = num_active;
+  if (vorticity == 0) {
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++) particles.forces[i] = Vector3D();
+    return;
+  }
 
-    if (p.omega.norm() > 1e-8) {
-      std::vector<Particle *> neighbors = neighborArray[i];
-      Vector3D pi = p.x_star;
-      Vector3D omega_i = p.omega;
-      for (Particle * &j: neighbors) {
-        N += (j->omega).norm()*del_W(pi-j->x_star); //TODO density might not be included.
-      }
-      if (N.norm() > 1e-8) N.normalize();
+  // eta = grad |omega| points towards the vortex core, and the confinement
+  // force spins the flow around it
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++){
+    const Vector3D &pi = particles.x_star[i];
+    double omega_i = particles.omega[i].norm();
+    Vector3D eta;
+    for (uint32_t j : neighbors[i]) {
+      eta += (particles.omega[j].norm() - omega_i)*del_W(pi - particles.x_star[j]);
     }
-    p.forces = vorticity*CGL::cross(N, p.omega);
+    double length = eta.norm();
+    particles.forces[i] = length > 1e-8 ? vorticity*CGL::cross(eta/length, particles.omega[i]) : Vector3D();
   }
 }
 
-void Fluid::update_omega(std::vector<std::vector<Particle *>> neighborArray){
-  //#pragma omp parallel for
-  for (int i = 0; i < particles.size(); i++){
-    Particle &p = particles[i];
-    std::vector<Particle *> neighbors = neighborArray[i];
+void Fluid::update_omega(const NeighborTable &neighbors){
+  max_omega = 0;
+  if (vorticity == 0 && !color_vorticity) return;
+  if (pair_traversal) {
+    update_omega_pairs(neighbors);
+    return;
+  }
 
+  // omega = curl v, from the neighbors' velocities relative to i
+  double volume = mass/RHO_O;
+  double max_norm = 0;
+  #pragma omp parallel for schedule(static) reduction(max:max_norm)
+  for (long i = 0; i < (long) num_active; i++){
     Vector3D accum;
-    Vector3D pi = p.x_star;
-    for (Particle * &j: neighbors) {
-      Vector3D vij =  j->velocity - p.velocity;
-      accum += CGL::cross(vij,del_W(pi-j->origin));
+    const Vector3D &pi = particles.x_star[i];
+    const Vector3D &vi = particles.velocity[i];
+    for (uint32_t j : neighbors[i]) {
+      accum += CGL::cross(particles.velocity[j] - vi, del_W(pi - particles.x_star[j]));
     }
-    p.omega = accum;
+    particles.omega[i] = volume*accum;
+    max_norm = max(max_norm, particles.omega[i].norm());
   }
+  max_omega = max_norm;
 }
 
-void Fluid::apply_viscosity(std::vector<std::vector<Particle *>> neighborArray) {
-  //#pragma omp parallel for
-  for (int i = 0; i < particles.size(); i++){
-    Particle &p = particles[i];
-    std::vector<Particle *> neighbors = neighborArray[i];
+void Fluid::apply_viscosity(const NeighborTable &neighbors) {
+  if (pair_traversal) {
+    apply_viscosity_pairs(neighbors);
+    return;
+  }
 
+  // Gather against the pre-sweep velocities and apply afterwards, so no
+  // thread reads a velocity another one is updating
+  long n = num_active;
+  viscosity_delta.resize(n);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++){
     Vector3D accum;
-    Vector3D pi = p.x_star;
-    for (Particle * &j: neighbors) {
-      Vector3D vij =  j->velocity - p.velocity;
-      accum += W(pi-j->x_star)*vij;
+    Vector3D pi = particles.x_star[i];
+    for (uint32_t j : neighbors[i]) {
+      Vector3D vij =  particles.velocity[j] - particles.velocity[i];
+      accum += W(pi-particles.x_star[j])*vij;
     }
+    viscosity_delta[i] = viscosity*accum; //TODO viscosity works, but need to use smaller hyperparams than paper
+  }
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) particles.velocity[i] += viscosity_delta[i];
+}
+
+void Fluid::update_lambdas_fused(const NeighborTable &neighbors) {
+  if (!simd_fused_sweeps()) {
+    update_lambdas_fused(neighbors, kernel, pair_cache);
+  } else if (single_precision) {
+    refresh_float_mirror();
+    pair_cache_f.resize(neighbors.indices.size());
+    fused_lambdas_simd(simd_isa, fused_sweep_f(neighbors), kernel_f.poly6, kernel_f.spiky);
+  } else {
+    pair_cache.resize(neighbors.indices.size());
+    fused_lambdas_simd(simd_isa, fused_sweep(neighbors), kernel.poly6, kernel.spiky);
+  }
+}
+
+void Fluid::update_delta_p_fused(const NeighborTable &neighbors) {
+  if (!simd_fused_sweeps()) {
+    update_delta_p_fused(neighbors, pair_cache);
+  } else if (single_precision) {
+    fused_delta_p_simd(simd_isa, fused_sweep_f(neighbors));
+  } else {
+    fused_delta_p_simd(simd_isa, fused_sweep(neighbors));
+  }
+}
+
+bool Fluid::simd_fused_sweeps() {
+  return simd_isa != SIMD_SCALAR && kernel.type == POLY6_SPIKY && num_active > 0;
+}
+
+FusedSweep Fluid::fused_sweep(const NeighborTable &neighbors) {
+  FusedSweep s;
+  s.n = num_active;
+  s.offsets = neighbors.offsets.data();
+  s.indices = neighbors.indices.data();
+  s.x_star = particles.x_star.data();
+  s.density = particles.density.data();
+  s.lambda = particles.lambda.data();
+  s.delta_p = particles.delta_p.data();
+  s.W = pair_cache.W.data();
+  s.del_W_x = pair_cache.del_W_x.data();
+  s.del_W_y = pair_cache.del_W_y.data();
+  s.del_W_z = pair_cache.del_W_z.data();
+  s.rho0 = RHO_O;
+  s.epsilon = EPSILON;
+  s.scorr_inv_W = pair_cache.scorr_inv_W;
+  return s;
+}
+
+FusedSweepF Fluid::fused_sweep_f(const NeighborTable &neighbors) {
+  FusedSweepF s;
+  s.n = num_active;
+  s.offsets = neighbors.offsets.data();
+  s.indices = neighbors.indices.data();
+  s.x_star = particles.x_star_f.data();
+  s.lambda_f = particles.lambda_f.data();
+  s.density = particles.density.data();
+  s.lambda = particles.lambda.data();
+  s.delta_p = particles.delta_p.data();
+  s.W = pair_cache_f.W.data();
+  s.del_W_x = pair_cache_f.del_W_x.data();
+  s.del_W_y = pair_cache_f.del_W_y.data();
+  s.del_W_z = pair_cache_f.del_W_z.data();
+  s.rho0 = RHO_O;
+  s.epsilon = EPSILON;
+  s.scorr_inv_W = pair_cache_f.scorr_inv_W;
+  return s;
+}
+
+void Fluid::refresh_float_mirror() {
+  // Sleeping particles keep their lambdas, so only theirs are copied; the
+  // lambda sweep writes the active ones. The spare position at the end keeps
+  // the sweeps' 16-byte loads of the last particle in bounds.
+  long n = particles.size();
+  particles.x_star_f.resize(n + 1);
+  particles.lambda_f.resize(n);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) {
+    particles.x_star_f[i] = Vec3<float>(particles.x_star[i]);
+    if (i >= (long) num_active) particles.lambda_f[i] = particles.lambda[i];
+  }
+}
 
-    p.velocity += viscosity*accum; //TODO viscosity works, but need to use smaller hyperparams than paper
+template <typename Real>
+void Fluid::update_lambdas_fused(const NeighborTable &neighbors, const SmoothingKernel<Real> &kernel,
+                                 PairCache<Real> &cache) {
+  switch (kernel.type) {
+    case POLY6:
+      update_lambdas_fused_sweep(neighbors, kernel.poly6, cache);
+      break;
+    case SPIKY:
+      update_lambdas_fused_sweep(neighbors, kernel.spiky, cache);
+      break;
+    case CUBIC_SPLINE:
+      update_lambdas_fused_sweep(neighbors, kernel.cubic_spline, cache);
+      break;
+    case WENDLAND:
+      update_lambdas_fused_sweep(neighbors, kernel.wendland, cache);
+      break;
+    default:
+      update_lambdas_fused_sweep(neighbors, KernelPair<Poly6<Real>, Spiky<Real> >(kernel.poly6, kernel.spiky), cache);
   }
+}
 
+template <typename Real, class Kernel>
+void Fluid::update_lambdas_fused_sweep(const NeighborTable &neighbors, const Kernel &k_W,
+                                       PairCache<Real> &cache) {
+  // Density and lambda in one sweep; W and del_W of every CSR entry are kept
+  // for update_delta_p_fused, which runs before x_star moves. Kernel math is
+  // done in Real, the density and gradient sums in double.
+  long n = num_active;
+  cache.resize(neighbors.indices.size());
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) {
+    const Vector3D &pi = particles.x_star[i];
+    double rho = 0;
+    double del_j = 0;
+    Vector3D del_i(0.0,0.0,0.0);
+    for (uint32_t k = neighbors.offsets[i]; k < neighbors.offsets[i + 1]; k++) {
+      Vec3<Real> r(pi - particles.x_star[neighbors.indices[k]]);
+      Real r2 = r.norm2();
+      Vec3<Real> g = k_W.grad_scale(r2)*r;
+      cache.W[k] = k_W.W(r2);
+      cache.del_W_x[k] = g.x;
+      cache.del_W_y[k] = g.y;
+      cache.del_W_z[k] = g.z;
+      rho += cache.W[k];
+      Vector3D del_temp = g.to_vector3D()/RHO_O;
+      del_i += del_temp;
+      del_j += del_temp.norm2();
+    }
+    particles.density[i] = rho;
+    double ci = rho/RHO_O - 1.0;
+    particles.lambda[i] = -ci/(del_j + del_i.norm2() + EPSILON);
+  }
+}
+
+template <typename Real>
+void Fluid::update_delta_p_fused(const NeighborTable &neighbors, const PairCache<Real> &cache) {
+  long n = num_active;
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++) {
+    Vec3<Real> delta;
+    Real l = particles.lambda[i];
+    for (uint32_t k = neighbors.offsets[i]; k < neighbors.offsets[i + 1]; k++) {
+      Real scorr = tensile_correction(cache.W[k], cache.scorr_inv_W);
+      Vec3<Real> g(cache.del_W_x[k], cache.del_W_y[k], cache.del_W_z[k]);
+      delta += (l + (Real) particles.lambda[neighbors.indices[k]] + scorr) * g;
+    }
+    particles.delta_p[i] = delta.to_vector3D() / RHO_O;
+  }
+}
+
+void Fluid::update_lambdas_pairs(const NeighborTable &neighbors) {
+  long n = num_active;
+  acc_density.reset(n);
+  acc_grad2.reset(n);
+  acc_vector.reset(n);
+  double w_self = W(Vector3D(0.0,0.0,0.0));
+
+  #pragma omp parallel
+  {
+    long begin, end;
+    thread_block(n, begin, end);
+    ThreadAccumulator<double>::Window &rho = acc_density.local(begin);
+    ThreadAccumulator<double>::Window &grad2 = acc_grad2.local(begin);
+    ThreadAccumulator<Vector3D>::Window &grad = acc_vector.local(begin);
+
+    for (long i = begin; i < end; i++) {
+      const Vector3D &pi = particles.x_star[i];
+      rho[i] += w_self;
+      for (uint32_t j : neighbors[i]) {
+        if ((long) j <= i) continue;
+        Vector3D r = pi - particles.x_star[j];
+        double w = W(r);
+        Vector3D g = del_W(r)/RHO_O;
+        double g_sq = g.norm2();
+        rho[i] += w;
+        grad[i] += g;
+        grad2[i] += g_sq;
+        // Sleeping neighbors are read but never written
+        if ((long) j >= n) continue;
+        rho[j] += w;
+        grad[j] -= g;
+        grad2[j] += g_sq;
+      }
+    }
+
+    #pragma omp barrier
+    ThreadAccumulator<double>::Block rho_sum = acc_density.block(begin, end);
+    ThreadAccumulator<double>::Block grad2_sum = acc_grad2.block(begin, end);
+    ThreadAccumulator<Vector3D>::Block grad_sum = acc_vector.block(begin, end);
+    for (long i = begin; i < end; i++) {
+      particles.density[i] = rho_sum.sum(i);
+      double ci = particles.density[i]/RHO_O - 1.0;
+      double sum_sq_norm = grad2_sum.sum(i) + grad_sum.sum(i).norm2();
+      particles.lambda[i] = -ci/(sum_sq_norm+EPSILON);
+    }
+  }
+}
+
+void Fluid::update_delta_p_pairs(const NeighborTable &neighbors) {
+  long n = num_active;
+  acc_vector.reset(n);
+
+  #pragma omp parallel
+  {
+    long begin, end;
+    thread_block(n, begin, end);
+    ThreadAccumulator<Vector3D>::Window &delta = acc_vector.local(begin);
+
+    for (long i = begin; i < end; i++) {
+      const Vector3D &pi = particles.x_star[i];
+      double li = particles.lambda[i];
+      for (uint32_t j : neighbors[i]) {
+        if ((long) j <= i) continue;
+        Vector3D r = pi - particles.x_star[j];
+        double scorr = s_corr(W(r));
+        Vector3D d = (li + particles.lambda[j] + scorr) * del_W(r);
+        delta[i] += d;
+        if ((long) j < n) delta[j] -= d;
+      }
+    }
+
+    #pragma omp barrier
+    ThreadAccumulator<Vector3D>::Block delta_sum = acc_vector.block(begin, end);
+    for (long i = begin; i < end; i++) {
+      particles.delta_p[i] = delta_sum.sum(i) / RHO_O;
+    }
+  }
+}
+
+void Fluid::update_omega_pairs(const NeighborTable &neighbors) {
+  // Both ends are taken at x_star so the pair term is the same for i and j
+  long n = num_active;
+  acc_vector.reset(n);
+  double volume = mass/RHO_O;
+  double max_norm = 0;
+
+  #pragma omp parallel reduction(max:max_norm)
+  {
+    long begin, end;
+    thread_block(n, begin, end);
+    ThreadAccumulator<Vector3D>::Window &omega = acc_vector.local(begin);
+
+    for (long i = begin; i < end; i++) {
+      const Vector3D &pi = particles.x_star[i];
+      const Vector3D &vi = particles.velocity[i];
+      for (uint32_t j : neighbors[i]) {
+        if ((long) j <= i) continue;
+        Vector3D w = CGL::cross(particles.velocity[j] - vi, del_W(pi - particles.x_star[j]));
+        omega[i] += w;
+        if ((long) j < n) omega[j] += w;
+      }
+    }
+
+    #pragma omp barrier
+    ThreadAccumulator<Vector3D>::Block omega_sum = acc_vector.block(begin, end);
+    for (long i = begin; i < end; i++) {
+      particles.omega[i] = volume*omega_sum.sum(i);
+      max_norm = max(max_norm, particles.omega[i].norm());
+    }
+  }
+  max_omega = max_norm;
+}
+
+void Fluid::apply_viscosity_pairs(const NeighborTable &neighbors) {
+  // Reads only pre-sweep velocities, like the per-particle loop; the
+  // barrier keeps every thread's reads ahead of the updates
+  long n = num_active;
+  acc_vector.reset(n);
+
+  #pragma omp parallel
+  {
+    long begin, end;
+    thread_block(n, begin, end);
+    ThreadAccumulator<Vector3D>::Window &accum = acc_vector.local(begin);
+
+    for (long i = begin; i < end; i++) {
+      const Vector3D &pi = particles.x_star[i];
+      const Vector3D &vi = particles.velocity[i];
+      for (uint32_t j : neighbors[i]) {
+        if ((long) j <= i) continue;
+        Vector3D v = W(pi - particles.x_star[j])*(particles.velocity[j] - vi);
+        accum[i] += v;
+        if ((long) j < n) accum[j] -= v;
+      }
+    }
+
+    #pragma omp barrier
+    ThreadAccumulator<Vector3D>::Block accum_sum = acc_vector.block(begin, end);
+    for (long i = begin; i < end; i++) {
+      particles.velocity[i] += viscosity*accum_sum.sum(i);
+    }
+  }
 }
 
 // ==================================neighbors=======================================
@@ -586,66 +1415,120 @@ std::vector<Particle *> Fluid::getNeighbors(Vector3D pos){
   return neighbors;
 }
 
-std::vector<std::vector<Particle *>> Fluid::build_index(){
-    // Populate cloud
-    this->cloud.pts = this->particles;
-
-    if (this->tree != NULL) free(this->tree);
-    this->tree =  new kdtree(3, cloud, KDTreeSingleIndexAdaptorParams(3));
-    this->tree->buildIndex();
+size_t Fluid::radius_search(const double *query_pt, double radius2,
+                            std::vector<std::pair<size_t,double> > &matches) {
+  // Queries whichever structure the last build_index() populated
+  if (neighbor_search == UNIFORM_GRID) {
+    return this->grid.radiusSearch(query_pt, radius2, matches);
+  }
+  SearchParams params;
+  params.sorted = false;
+  // The kd-tree's splits come from the positions at its last build, so grow
+  // the radius by how far particles may have moved since.
+  double r = sqrt(radius2) + index_slack;
+  return this->tree->radiusSearch(query_pt, r*r, matches, params);
+}
 
-    std::vector<std::pair<size_t,double> > ret_matches;
-    SearchParams params;
-    params.sorted = false;
+bool Fluid::neighbors_stale() {
+  if (neighbor_skin <= 0 || neighbors.size() != num_active) return true;
 
-    double query_pt[3] = {0.5,0.5,0.5};
+  double max_disp2 = 0;
+  #pragma omp parallel for schedule(static) reduction(max:max_disp2)
+  for (long i = 0; i < (long) num_active; i++) {
+    max_disp2 = max(max_disp2, (particles.x_star[i] - build_positions[i]).norm2());
+  }
+  if (max_disp2 > 0.25*neighbor_skin*neighbor_skin) return true;
 
-    std::vector<std::vector<Particle *>> to_return;
-    for  (int k =0; k < particles.size(); k++){
-      std::vector<Particle *> to_append;
+  index_slack = sqrt(max_disp2);
+  neighbor_stats.max_displacement = max(neighbor_stats.max_displacement, index_slack);
+  return false;
+}
 
-      query_pt[0] = particles[k].x_star.x;
-      query_pt[1] = particles[k].x_star.y;
-      query_pt[2] = particles[k].x_star.z;
+void Fluid::print_solver_stats() {
+  if (solver_stats.steps == 0) return;
+  cout << "[Fluid] " << (double) solver_stats.iterations/solver_stats.steps
+       << " solver iterations per step (" << solver_iters << " max, "
+       << solver_stats.capped << " of " << solver_stats.steps << " steps capped), "
+       << (tolerance_on_max ? "max" : "mean") << " density error "
+       << solver_stats.residual_sum/solver_stats.steps << " avg, "
+       << solver_stats.max_residual << " worst, tolerance " << density_tolerance << endl;
+}
 
-      double nMatches = this->tree->radiusSearch(&query_pt[0], R*R, ret_matches, params); //TODO should be R or squared?
+void Fluid::print_neighbor_stats() {
+  // Without a skin every step rebuilds, so there is nothing to report
+  if (neighbor_skin <= 0) return;
+  size_t steps = neighbor_stats.builds + neighbor_stats.reuses;
+  if (steps == 0) return;
+  cout << "[Fluid] neighbor lists rebuilt " << neighbor_stats.builds << " of " << steps
+       << " steps (" << 100.0*neighbor_stats.builds/steps << "%), skin " << neighbor_skin
+       << ", max displacement at reuse " << neighbor_stats.max_displacement << endl;
+}
 
-      for (auto &pair: ret_matches) {
-        to_append.emplace_back(&(this->particles[pair.first]));
-      }
-      to_return.emplace_back(to_append);
-      // cout << to_append.size() << endl;
+const NeighborTable &Fluid::build_index(){
+    if (!neighbors_stale()) {
+      neighbor_stats.reuses++;
+      return neighbors;
+    }
+    neighbor_stats.builds++;
+    index_slack = 0;
+
+    double search_radius = R + neighbor_skin;
+    if (neighbor_search == UNIFORM_GRID) {
+      this->grid.build(this->particles.x_star, search_radius);
+    } else {
+      build_tree();
     }
 
-    return to_return;
-}
+    // Sleeping particles are indexed but get no list of their own
+    query.run(num_active, [&](size_t k, std::vector<std::pair<size_t,double> > &ret_matches) {
+      const Vector3D &x = particles.x_star[k];
+      double query_pt[3] = {x.x, x.y, x.z};
+      radius_search(&query_pt[0], search_radius*search_radius, ret_matches);
+    }, neighbors);
 
-std::vector<std::vector<Particle *>> Fluid::build_nearest_neighbors_index(int numNeighbors){
-    //Finds numNeighbors nearest neighbors for each particle
-    // Populate cloud
-    this->cloud.pts = this->particles;
+    if (neighbor_skin > 0) {
+      build_positions = particles.x_star;
+    }
 
-    kdtree index(3, cloud, KDTreeSingleIndexAdaptorParams(3));
-    index.buildIndex();
+    return neighbors;
+}
 
-    double query_pt[3] = {0.5,0.5,0.5};
+void Fluid::build_tree() {
+  // The cloud points at the live particles, so nothing is copied. Positions
+  // that move after the build are covered by index_slack in radius_search.
+  cloud.pts = particles.x_star.data();
+  cloud.count = particles.size();
 
-    std::vector<std::vector<Particle *>> to_return;
-    for  (int k =0; k < particles.size(); k++){
-      std::vector<Particle *> to_append;
+  if (this->tree != NULL) delete this->tree;
+  this->tree =  new kdtree(3, cloud, KDTreeSingleIndexAdaptorParams(3));
+  this->tree->buildIndex();
+  index_slack = 0;
+}
 
-      query_pt[0] = particles[k].x_star.x;
-      query_pt[1] = particles[k].x_star.y;
-      query_pt[2] = particles[k].x_star.z;
+void Fluid::build_nearest_neighbors_index(int numNeighbors, NeighborTable &to_return){
+    //Finds numNeighbors nearest neighbors for each particle
+    // kNN has no slack to absorb moved particles, so index current positions;
+    // the tree is shared with radius_search rather than built on the side
+    build_tree();
+    knn_search_batch(particles.x_star, numNeighbors, to_return);
+}
 
-      std::vector<size_t> ret_index(numNeighbors);
-      std::vector<double> dist_sq(numNeighbors);
+void Fluid::radius_search_batch(const vector<Vector3D> &points, double radius, NeighborTable &out) {
+  query.run(points.size(), [&](size_t q, std::vector<std::pair<size_t,double> > &ret_matches) {
+    double query_pt[3] = {points[q].x, points[q].y, points[q].z};
+    radius_search(&query_pt[0], radius*radius, ret_matches);
+  }, out);
+}
 
-      int num_results = index.knnSearch(&query_pt[0], numNeighbors, &ret_index[0], &dist_sq[0]);
-      for (int i = 0; i < numNeighbors; i++) to_append.emplace_back(&(particles[ret_index[i]]));
-      to_return.emplace_back(to_append);
-    }
-    return to_return;
+void Fluid::knn_search_batch(const vector<Vector3D> &points, int k, NeighborTable &out) {
+  query.run(points.size(), [&](size_t q, std::vector<std::pair<size_t,double> > &ret_matches) {
+    double query_pt[3] = {points[q].x, points[q].y, points[q].z};
+    std::vector<size_t> ret_index(k);
+    std::vector<double> dist_sq(k);
+    size_t num_results = this->tree->knnSearch(&query_pt[0], k, &ret_index[0], &dist_sq[0]);
+    ret_matches.clear();
+    for (size_t i = 0; i < num_results; i++) ret_matches.emplace_back(ret_index[i], dist_sq[i]);
+  }, out);
 }
 
 double Fluid::isotropic_kernel(Vector3D pos){
@@ -657,17 +1540,14 @@ double Fluid::isotropic_kernel(Vector3D pos){
 
 
   std::vector<std::pair<size_t,double> > ret_matches;
-  SearchParams params;
-  params.sorted = false;
 
   double query_pt[3] = {pos.x,pos.y,pos.z};
 
   double to_return=0;
 
-  double nMatches = this->tree->radiusSearch(&query_pt[0], R*R, ret_matches, params);
+  double nMatches = radius_search(&query_pt[0], R*R, ret_matches);
   for (auto &pair: ret_matches) {
-    Particle p = this->particles[pair.first];
-    to_return += W(pos-p.x_star);///p.density; //TODO density is from previous time step
+    to_return += W(pos-this->particles.x_star[pair.first]);///p.density; //TODO density is from previous time step
   }
   // cout << to_return << endl;
 
@@ -683,17 +1563,25 @@ void Fluid::save_state_to_csv() {
   std::string filename = "state.csv";
   fs.open(filename, std::ios_base::app);
   int neighborhood_size = 20;
-  std::vector<std::vector<Particle *>> neighborArray = build_nearest_neighbors_index(neighborhood_size);
-  for (int i = 0; i < particles.size(); i++) {
+  NeighborTable neighborArray;
+  build_nearest_neighbors_index(neighborhood_size, neighborArray);
+
+  // Rows are written in seeding order whatever the current particle order
+  std::vector<uint32_t> by_id(particles.size());
+  for (size_t i = 0; i < particles.size(); i++) by_id[particles.id[i]] = i;
+
+  for (uint32_t i : by_id) {
     // write self state
-    Particle *p = &particles[i];
-    fs << p->origin.x << "," << p->origin.y << "," << p->origin.z << ","
-       << p->velocity.x << "," << p->velocity.y << "," << p->velocity.z << std::endl;
+    const Vector3D *x = &particles.origin[i], *v = &particles.velocity[i];
+    fs << x->x << "," << x->y << "," << x->z << ","
+       << v->x << "," << v->y << "," << v->z << std::endl;
     // std::cout << neighborArray[i].size() << '\n';
     for (int j = 0; j < neighborhood_size; j++) {
-      p = neighborArray[i][j];
-      fs << p->origin.x << "," << p->origin.y << "," << p->origin.z << ","
-         << p->velocity.x << "," << p->velocity.y << "," << p->velocity.z << std::endl;
+      uint32_t k = neighborArray.indices[neighborArray.offsets[i] + j];
+      x = &particles.origin[k];
+      v = &particles.velocity[k];
+      fs << x->x << "," << x->y << "," << x->z << ","
+         << v->x << "," << v->y << "," << v->z << std::endl;
     }
   }
   fs << -1 << "," << -1 << "," << -1 << ","
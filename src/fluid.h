@@ -1,6 +1,8 @@
 #ifndef FLUID_H
 #define FLUID_H
 
+#include <cfloat>
+#include <cstdint>
 #include <unordered_set>
 #include <unordered_map>
 #include <vector>
@@ -9,8 +11,17 @@
 #include "CGL/misc.h"
 #include "collision/collisionObject.h"
 #include "collision/particle.h"
+#include "kernels.h"
 #include "nanoflann.hpp"
+#include "neighborQuery.h"
+#include "neighborTable.h"
+#include "parallel.h"
+#include "particleStore.h"
+#include "simd.h"
+#include "solver.h"
+#include "uniformGrid.h"
 #include "utils.h"
+#include "vec3.h"
 
 using namespace CGL;
 using namespace std;
@@ -38,6 +49,7 @@ struct vertex {
 };
 
 enum e_orientation { HORIZONTAL = 0, VERTICAL = 1 };
+enum e_neighbor_search { KDTREE = 0, UNIFORM_GRID = 1 };
 
 struct FluidParameters {
   FluidParameters() {}
@@ -55,6 +67,76 @@ struct FluidParameters {
   double ks;
 };
 
+// How often the neighbor lists had to be rebuilt during a run
+struct NeighborStats {
+  size_t builds = 0;
+  size_t reuses = 0;
+  double max_displacement = 0; // largest displacement seen at a reuse
+};
+
+// Per-pair kernel cache of the fused solver, in the scalar type it runs at.
+// W[k] and the del_W components at k belong to CSR entry k of the neighbor
+// table; components are kept in separate arrays for the SIMD sweeps.
+template <typename Real>
+struct PairCache {
+  void resize(size_t n) {
+    W.resize(n);
+    del_W_x.resize(n);
+    del_W_y.resize(n);
+    del_W_z.resize(n);
+  }
+
+  Real scorr_inv_W;
+  vector<Real> W;
+  vector<Real> del_W_x, del_W_y, del_W_z;
+};
+
+// Solver iterations actually run when a density tolerance is set
+struct SolverStats {
+  size_t steps = 0;
+  size_t iterations = 0;
+  size_t capped = 0;        // steps that hit solver_iters before converging
+  double residual_sum = 0;  // density error each step stopped at
+  double max_residual = 0;
+};
+
+// Steps taken by simulate_frame() under adaptive time stepping
+struct StepStats {
+  size_t frames = 0;
+  size_t steps = 0;
+  double min_dt = DBL_MAX;
+  double max_dt = 0;
+};
+
+// Activity of one R-sized cell, see Fluid::sleeping
+struct SleepCell {
+  uint32_t seen = 0;       // last step an awake particle was in it
+  uint32_t near_loud = 0;  // last step it or a neighbor cell was loud
+  int quiet = 0;           // consecutive steps without a loud particle
+  bool asleep = false;
+  bool loud = false;       // some awake particle in it is loud this step
+};
+
+// Awake particles per step and cell transitions under sleeping
+struct SleepStats {
+  size_t steps = 0;
+  size_t awake = 0;       // summed over steps
+  size_t min_awake = SIZE_MAX;
+  size_t sleeps = 0;
+  size_t wakes = 0;
+};
+
+// Obstacle collision tests with and without the broad phase
+struct BroadPhaseStats {
+  size_t steps = 0;
+  size_t cells = 0;       // grid cells tagged, summed over steps
+  size_t tests = 0;       // particle-obstacle tests run
+  size_t candidates = 0;  // tests every particle against every obstacle would take
+  size_t fallbacks = 0;   // collision passes that tested every particle
+};
+
+struct Container;
+
 struct Fluid {
   Fluid() {}
   Fluid(double width, double length, double height, double particle_radius,
@@ -68,6 +150,12 @@ struct Fluid {
   void simulate(double frames_per_sec, double simulation_steps, FluidParameters *fp,
                 vector<Vector3D> external_accelerations,
                 vector<CollisionObject *> *collision_objects, int step);
+  // One output frame of CFL-limited steps, see adaptive_dt
+  void simulate_frame(double frames_per_sec, vector<Vector3D> external_accelerations,
+                      vector<CollisionObject *> *collision_objects, int frame);
+  // One step of length delta_t; exports voxels for frame unless it is < 0
+  void advance(double delta_t, vector<Vector3D> &external_accelerations,
+               vector<CollisionObject *> *collision_objects, int frame);
 
   void reset();
   void saveVoxelsToMitsuba(std::string fileName, Vector3D min, Vector3D max, bool orientation);
@@ -82,8 +170,82 @@ struct Fluid {
   int num_length_points;
   int num_height_points;
   int neighborhood_particle;
+
+  // Pressure solver behind advance(), created from solver_type by buildGrid()
+  e_solver solver_type = PBF_SOLVER;
+  FluidSolver *solver = NULL;
+  void init_solver();
+
   int solver_iters = 3;
 
+  // Adaptive time stepping: simulate_frame() is used instead of a fixed
+  // number of simulate() calls per frame, and picks each dt so no particle
+  // moves more than cfl*R, clamped to [min_dt, max_dt]
+  bool adaptive_dt = false;
+  double cfl = 0.4;
+  double min_dt = 1e-4;
+  double max_dt = 0.01;
+  StepStats step_stats;
+  double cfl_dt();
+  void print_step_stats();
+
+  // Tolerance mode: with density_tolerance > 0 the solver loop stops once
+  // the mean (or, with tolerance_on_max, the max) |C_i| drops below it,
+  // after at least min_solver_iters and at most solver_iters iterations
+  double density_tolerance = 0;
+  bool tolerance_on_max = false;
+  int min_solver_iters = 1;
+  bool log_solver = false;
+
+  // Seed each step with one position correction from the previous step's
+  // lambdas before the first solver iteration
+  bool warm_start = false;
+
+  // Chebyshev semi-iterative acceleration of the solver loop: after
+  // chebyshev_delay plain Jacobi iterations every position update is
+  // over-relaxed against the iterate before it, with weights from the
+  // spectral radius chebyshev_rho of the Jacobi iteration. chebyshev_rho = 0
+  // estimates it each step (up to 0.99) from how much the last plain
+  // iteration cut the mean density error. An accelerated iteration that
+  // raises the error drops the rest of the step back to plain Jacobi.
+  bool chebyshev = false;
+  double chebyshev_rho = 0;
+  int chebyshev_delay = 2;
+  SolverStats solver_stats;
+  void print_solver_stats();
+
+  // DFSPH: the density solver iterates until the mean compression predicted
+  // for the end of the step is below dfsph_density_tolerance (relative to
+  // RHO_O), the divergence solver until the mean compression rate times
+  // delta_t is below dfsph_divergence_tolerance, each for at most
+  // dfsph_max_iters iterations
+  double dfsph_density_tolerance = 0.001;
+  double dfsph_divergence_tolerance = 0.001;
+  int dfsph_max_iters = 100;
+  bool divergence_solve = true;
+
+  // Sleeping: particles are binned into R-sized cells covering
+  // minBoundaries..maxBoundaries, particles outside sharing the border cells.
+  // A cell whose particles all stayed under sleep_velocity, with their
+  // density error changing by less than sleep_density_error per step, for
+  // sleep_steps steps falls asleep unless a neighbor cell is loud. Its
+  // particles are frozen and moved behind the first num_active slots, which
+  // are all the step loops run over; sleepers still count as neighbors of
+  // awake particles. A loud cell wakes itself and the 26 around it.
+  bool sleeping = false;
+  double sleep_velocity = 0.05;
+  double sleep_density_error = 0.01;
+  int sleep_steps = 30;
+  size_t num_active = 0;
+  vector<SleepCell> sleep_cells;
+  int sleep_dims[3] = {0, 0, 0};
+  vector<uint32_t> touched_cells;
+  vector<double> sleep_density; // density at the previous sleeping pass
+  SleepStats sleep_stats;
+  uint32_t sleep_cell(const Vector3D &x);
+  void update_sleeping();
+  void print_sleep_stats();
+
   Vector3D num_cells;
   bool firstFile = true;
   double viscosity;
@@ -100,15 +262,19 @@ struct Fluid {
   
   int numberCube;
 
+  // Solver threads (0 keeps the OpenMP default), and whether simulate()
+  // writes the density voxels used for surfacing every step
+  int threads = 0;
+  bool export_voxels = true;
+
   double R=0.15;
-  double W_CONSTANT =  315.0/(64.0*M_PI*R*R*R*R*R*R*R*R*R);
-  double W_DEL_CONSTANT = 45.0/(M_PI*pow(R,6.0)); //TODO this maybe negated
+  e_kernel kernel_type = POLY6_SPIKY;
 
   Vector3D maxBoundaries;
   Vector3D minBoundaries;
 
   // Fluid components
-  vector<Particle> particles;
+  ParticleStore particles;
 
   // Spatial hashing
   unordered_map<string, vector<Particle *> *> map;
@@ -125,30 +291,151 @@ struct Fluid {
 
   std::vector<Particle *> getNeighbors(Vector3D pos);
 
+  // Kernel of support R picked by kernel_type; init_kernel() folds its
+  // constants and is called from buildGrid()
+  SmoothingKernel<double> kernel;
+  SmoothingKernel<float> kernel_f;
+  double scorr_inv_W;
+  void init_kernel();
   double W(Vector3D r);
   Vector3D del_W(Vector3D r);
-  double C_i(Particle p);
-  double density(Particle p, std::vector<Particle *> neighbors);
-  void update_delta_p(std::vector<std::vector<Particle *>> neighborArray);
+  double s_corr(double w);
+  double C_i(size_t i);
+  // Mean and max |rho_i/RHO_O - 1| as of the last density evaluation
+  double mean_density_error();
+  double max_density_error();
+  double density(size_t i, const NeighborTable &neighbors);
+  // use_pair_cache = false recomputes the kernels even in the fused solver,
+  // for when the cache predates the current positions or neighbor lists
+  void update_delta_p(const NeighborTable &neighbors, bool use_pair_cache = true);
+  // With previous, x_star moves to previous + weight*(x_star + delta_p*sf -
+  // previous) before the colliders run, and previous takes the old x_star
+  void apply_delta_p(vector<CollisionObject *> *collision_objects, double weight = 1,
+                     vector<Vector3D> *previous = NULL);
   // double rho_i(Particle p);
-  double lambda(Particle i, std::vector<std::vector<Particle *>>  neighborArray);
-  void update_lambdas(std::vector<std::vector<Particle *>>  neighborArray);
-  Vector3D del_ci_i(Particle i, std::vector<Particle *> neighbors);
+  void update_lambdas(const NeighborTable &neighbors);
+  Vector3D del_ci_i(size_t i, const NeighborTable &neighbors);
+
+  Vector3D del_ci_j(size_t i, size_t k);
 
-  Vector3D del_ci_j(Particle i, Particle k);
+  // Vorticity confinement in two sweeps: update_omega() estimates omega =
+  // curl v and its largest norm, which also colours the particles, and
+  // apply_vorticity() turns grad |omega| into the confinement acceleration
+  // in forces. With vorticity = 0 and color_vorticity off neither sweeps.
+  void apply_vorticity(const NeighborTable &neighbors);
+  void apply_viscosity(const NeighborTable &neighbors);
+  void update_omega(const NeighborTable &neighbors);
+  bool color_vorticity = true;
+  double max_omega = 0;
+  vector<Vector3D> viscosity_delta;
 
-  void apply_vorticity(std::vector<std::vector<Particle *>> neighborArray);
-  void apply_viscosity(std::vector<std::vector<Particle *>> neighborArray);
-  void update_omega(std::vector<std::vector<Particle *>> neighborArray);
+  // Half-pair traversal: each unordered pair (i, j) is visited once from
+  // min(i, j) and its kernel terms are scattered into both particles
+  bool pair_traversal = false;
+  ThreadAccumulator<double> acc_density;
+  ThreadAccumulator<double> acc_grad2;
+  ThreadAccumulator<Vector3D> acc_vector;
+  void update_lambdas_pairs(const NeighborTable &neighbors);
+  void update_delta_p_pairs(const NeighborTable &neighbors);
+  void apply_viscosity_pairs(const NeighborTable &neighbors);
+  void update_omega_pairs(const NeighborTable &neighbors);
+
+  // Fused solver: the lambda sweep evaluates W and del_W once per CSR entry
+  // and the delta_p sweep reads them back instead of recomputing. With
+  // single_precision the SIMD sweeps gather float positions and lambdas and
+  // keep a float cache; init_kernel() falls back to double where they can't
+  // run.
+  bool fused_solver = false;
+  bool single_precision = false;
+  PairCache<double> pair_cache;
+  PairCache<float> pair_cache_f;
+  void update_lambdas_fused(const NeighborTable &neighbors);
+  void update_delta_p_fused(const NeighborTable &neighbors);
+  template <typename Real>
+  void update_lambdas_fused(const NeighborTable &neighbors, const SmoothingKernel<Real> &kernel,
+                            PairCache<Real> &cache);
+  template <typename Real, class Kernel>
+  void update_lambdas_fused_sweep(const NeighborTable &neighbors, const Kernel &k_W,
+                                  PairCache<Real> &cache);
+  template <typename Real>
+  void update_delta_p_fused(const NeighborTable &neighbors, const PairCache<Real> &cache);
+
+  // The Poly6/Spiky fused sweeps also have AVX2 and AVX-512 versions in
+  // double and float (simd.h); init_kernel() picks the widest the CPU
+  // supports unless simd is off, and every other configuration runs the
+  // scalar templates above in double
+  bool simd = true;
+  e_simd simd_isa = SIMD_SCALAR;
+  bool simd_fused_sweeps();
+  FusedSweep fused_sweep(const NeighborTable &neighbors);
+  FusedSweepF fused_sweep_f(const NeighborTable &neighbors);
+  void refresh_float_mirror();
 
   PointCloud cloud;
   typedef KDTreeSingleIndexAdaptor< L2_Simple_Adaptor<double, PointCloud> , PointCloud, 3 > kdtree;
-  std::vector<std::vector<Particle *>> build_index();
-  std::vector<std::vector<Particle *>> build_nearest_neighbors_index(int numNeighbors);
+  e_neighbor_search neighbor_search = UNIFORM_GRID;
+  UniformGrid grid;
+  size_t radius_search(const double *query_pt, double radius2,
+                       std::vector<std::pair<size_t,double> > &matches);
+
+  // Neighbors within R of every particle, refilled in place by build_index
+  NeighborTable neighbors;
+  const NeighborTable &build_index();
+
+  // Verlet skin: lists are built with radius R + neighbor_skin and reused
+  // until some particle has moved more than neighbor_skin/2 since the build
+  double neighbor_skin = 0;
+  double index_slack = 0;
+  vector<Vector3D> build_positions;
+  NeighborStats neighbor_stats;
+  bool neighbors_stale();
+  void print_neighbor_stats();
+
+  // Broad phase: once per step every collider with bounds() tags the grid
+  // cells its box overlaps, grown by the reach a particle may travel from
+  // where it was binned during the step, and only particles binned in those
+  // cells are tested against it. Colliders without bounds, like planes and
+  // the container, still test every particle. Under the kd-tree the
+  // particles are tagged one by one. A PBF collision pass in which some
+  // particle has moved farther than the reach from its x_star at tagging
+  // time tests every particle instead.
+  bool broad_phase = true;
+  vector<vector<uint32_t>> collider_particles; // per collider, increasing
+  vector<bool> collider_culled;
+  bool broad_phase_culling = false;  // some collider is culled this step
+  double broad_phase_reach = 0;
+  vector<Vector3D> broad_phase_positions;  // x_star when the lists were made
+  size_t collider_tests = 0;  // narrow-phase tests in one collision pass
+  size_t collider_candidates = 0;
+  BroadPhaseStats broad_phase_stats;
+  void update_broad_phase(vector<CollisionObject *> *collision_objects, double reach);
+  // Counts one collision pass and returns the container to fuse into it
+  const Container *begin_collisions(vector<CollisionObject *> *collision_objects);
+  // Every collider but the container on particles begin..end-1, without
+  // the broad phase unless cull
+  void collide_block(vector<CollisionObject *> *collision_objects, const Container *container,
+                     long begin, long end, bool cull = true);
+  void print_broad_phase_stats();
+
+  // Every reorder_interval steps particles are sorted by the Morton code of
+  // their R-sized cell so spatial neighbors are also close in memory
+  int reorder_interval = 0;
+  size_t steps_taken = 0;
+  void reorder_particles();
+  void permute_particles(const vector<uint32_t> &order);
+
+  void build_nearest_neighbors_index(int numNeighbors, NeighborTable &to_return);
+
+  // Parallel batched queries against the current index, one CSR row per
+  // point. kNN needs the kd-tree, see build_tree.
+  NeighborQuery query;
+  void radius_search_batch(const vector<Vector3D> &points, double radius, NeighborTable &out);
+  void knn_search_batch(const vector<Vector3D> &points, int k, NeighborTable &out);
 
   double isotropic_kernel(Vector3D pos);
 
   kdtree *tree = NULL;
+  void build_tree();
 
   void save_state_to_csv();
   void saveVoxelToCSV(std::string fileName, Vector3D min, Vector3D sizeCell);
@@ -50,6 +50,7 @@ FluidSimulator::~FluidSimulator() {
 
 void FluidSimulator::loadFluid(Fluid *fluid) {
   this->fluid = fluid;
+  frames_per_sec = fluid->fps;
 
   g_vertex_buffer_data = fluid->getBuffer();
 
@@ -117,8 +118,8 @@ void FluidSimulator::init() {
 
   Vector3D avg_p_position(0, 0, 0);
 
-  for (auto &p : fluid->particles) {
-    avg_p_position += p.origin;
+  for (const Vector3D &origin : fluid->particles.origin) {
+    avg_p_position += origin;
   }
 
   avg_p_position /= fluid->particles.size();
@@ -164,8 +165,12 @@ void FluidSimulator::drawContents() {
   if (!is_paused) {
     vector<Vector3D> external_accelerations = {gravity};
 
-    for (int i = 0; i < simulation_steps; i++) {
-      fluid->simulate(frames_per_sec, simulation_steps, fp, external_accelerations, collision_objects, step);
+    if (fluid->adaptive_dt) {
+      fluid->simulate_frame(frames_per_sec, external_accelerations, collision_objects, step);
+    } else {
+      for (int i = 0; i < simulation_steps; i++) {
+        fluid->simulate(frames_per_sec, simulation_steps, fp, external_accelerations, collision_objects, step);
+      }
     }
   }
 
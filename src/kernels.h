@@ -0,0 +1,176 @@
+#ifndef FLUID_KERNELS_H
+#define FLUID_KERNELS_H
+
+#include <cmath>
+
+using namespace std;
+
+/*
+  SPH smoothing kernels with support radius h.
+
+  Every kernel is evaluated from the squared distance r2 = |r|^2:
+    W(r2)           kernel value
+    grad_scale(r2)  s such that grad W(r) = s * r
+  Constants are folded at init() and the bodies are plain polynomials, so
+  no pow() runs per pair. Poly6 never needs |r|; the others take one sqrt.
+*/
+
+#define KERNEL_PI 3.14159265358979323846
+
+template <typename Real>
+struct Poly6 {
+  void init(Real h) {
+    h2 = h*h;
+    c_W = 315.0/(64.0*KERNEL_PI*h2*h2*h2*h2*h);
+    c_grad = -6*c_W;
+  }
+  Real W(Real r2) const {
+    if (r2 >= h2) return 0;
+    Real d = h2 - r2;
+    return c_W*d*d*d;
+  }
+  Real grad_scale(Real r2) const {
+    if (r2 >= h2) return 0;
+    Real d = h2 - r2;
+    return c_grad*d*d;
+  }
+  Real h2, c_W, c_grad;
+};
+
+template <typename Real>
+struct Spiky {
+  void init(Real h) {
+    this->h = h;
+    h2 = h*h;
+    c_W = 15.0/(KERNEL_PI*h2*h2*h2);
+    c_grad = -3*c_W;
+  }
+  Real W(Real r2) const {
+    if (r2 >= h2) return 0;
+    Real d = h - sqrt(r2);
+    return c_W*d*d*d;
+  }
+  Real grad_scale(Real r2) const {
+    if (r2 >= h2 || r2 <= 0) return 0;
+    Real r = sqrt(r2);
+    Real d = h - r;
+    return c_grad*d*d/r;
+  }
+  Real h, h2, c_W, c_grad;
+};
+
+// Monaghan's cubic B-spline, q = r/h
+template <typename Real>
+struct CubicSpline {
+  void init(Real h) {
+    inv_h = 1/h;
+    h2 = h*h;
+    c_W = 8.0/(KERNEL_PI*h*h*h);
+    c_grad = 6*c_W*inv_h;
+  }
+  Real W(Real r2) const {
+    if (r2 >= h2) return 0;
+    Real q = sqrt(r2)*inv_h;
+    if (q <= 0.5) return c_W*(6*q*q*(q - 1) + 1);
+    Real d = 1 - q;
+    return c_W*2*d*d*d;
+  }
+  Real grad_scale(Real r2) const {
+    if (r2 >= h2 || r2 <= 0) return 0;
+    Real r = sqrt(r2);
+    Real q = r*inv_h;
+    // dW/dr divided by r; the inner branch cancels the 1/r
+    if (q <= 0.5) return c_grad*inv_h*(3*q - 2);
+    Real d = 1 - q;
+    return -c_grad*d*d/r;
+  }
+  Real inv_h, h2, c_W, c_grad;
+};
+
+// Wendland C2, q = r/h
+template <typename Real>
+struct Wendland {
+  void init(Real h) {
+    inv_h = 1/h;
+    h2 = h*h;
+    c_W = 21.0/(2.0*KERNEL_PI*h*h*h);
+    c_grad = -20*c_W*inv_h*inv_h;
+  }
+  Real W(Real r2) const {
+    if (r2 >= h2) return 0;
+    Real q = sqrt(r2)*inv_h;
+    Real d = 1 - q;
+    Real d2 = d*d;
+    return c_W*d2*d2*(1 + 4*q);
+  }
+  Real grad_scale(Real r2) const {
+    if (r2 >= h2) return 0;
+    Real d = 1 - sqrt(r2)*inv_h;
+    return c_grad*d*d*d;
+  }
+  Real inv_h, h2, c_W, c_grad;
+};
+
+// Values from one kernel, gradients from another (PBF pairs Poly6 with Spiky)
+template <class Density, class Gradient>
+struct KernelPair {
+  KernelPair(const Density &density, const Gradient &gradient)
+      : density(density), gradient(gradient) {}
+  typedef decltype(Density().W(0)) Real;
+  Real W(Real r2) const { return density.W(r2); }
+  Real grad_scale(Real r2) const { return gradient.grad_scale(r2); }
+  const Density &density;
+  const Gradient &gradient;
+};
+
+// PBF's artificial pressure -k (W/W(dq))^n with k = 0.001, n = 4
+template <typename Real>
+inline Real tensile_correction(Real w, Real inv_W_dq) {
+  Real s = w*inv_W_dq;
+  s *= s;
+  return -0.001*s*s;
+}
+
+enum e_kernel { POLY6_SPIKY = 0, POLY6 = 1, SPIKY = 2, CUBIC_SPLINE = 3, WENDLAND = 4 };
+
+/*
+  Kernel chosen at run time from the scene. W and grad_scale switch on the
+  type per call; hot loops that want the kernel inlined dispatch once on
+  type and call a template instantiated on the concrete kernel instead.
+*/
+template <typename Real>
+struct SmoothingKernel {
+  void init(e_kernel type, Real h) {
+    this->type = type;
+    poly6.init(h);
+    spiky.init(h);
+    cubic_spline.init(h);
+    wendland.init(h);
+  }
+
+  Real W(Real r2) const {
+    switch (type) {
+      case SPIKY: return spiky.W(r2);
+      case CUBIC_SPLINE: return cubic_spline.W(r2);
+      case WENDLAND: return wendland.W(r2);
+      default: return poly6.W(r2);
+    }
+  }
+
+  Real grad_scale(Real r2) const {
+    switch (type) {
+      case POLY6: return poly6.grad_scale(r2);
+      case CUBIC_SPLINE: return cubic_spline.grad_scale(r2);
+      case WENDLAND: return wendland.grad_scale(r2);
+      default: return spiky.grad_scale(r2);
+    }
+  }
+
+  e_kernel type = POLY6_SPIKY;
+  Poly6<Real> poly6;
+  Spiky<Real> spiky;
+  CubicSpline<Real> cubic_spline;
+  Wendland<Real> wendland;
+};
+
+#endif /* FLUID_KERNELS_H */
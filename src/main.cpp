@@ -1,4 +1,5 @@
 #include <cfloat>
+#include <chrono>
 #include <getopt.h>
 #include <iostream>
 #include <fstream>
@@ -9,7 +10,10 @@
 #include <unordered_set>
 
 #include "CGL/CGL.h"
+#include "collision/container.h"
+#include "collision/mesh.h"
 #include "collision/plane.h"
+#include "collision/sdf.h"
 #include "collision/triangle.h"
 #include "collision/sphere.h"
 #include "fluid.h"
@@ -35,8 +39,9 @@ const string TRIANGLE = "triangle";
 const string OBJECT = "object";
 const string FLUID = "fluid";
 const string BOUNDINGBOX = "boundingBox";
+const string SDF = "sdf";
 
-const unordered_set<string> VALID_KEYS = {SPHERE, PLANE, PARTICLE, TRIANGLE, FLUID, OBJECT, BOUNDINGBOX};
+const unordered_set<string> VALID_KEYS = {SPHERE, PLANE, PARTICLE, TRIANGLE, FLUID, OBJECT, BOUNDINGBOX, SDF};
 
 FluidSimulator *app = nullptr;
 GLFWwindow *window = nullptr;
@@ -146,6 +151,11 @@ void usageError(const char *binaryName) {
   printf("Required program options:\n");
   printf("  -f     <STRING>    Filename of scene");
   printf("\n");
+  printf("Optional program options:\n");
+  printf("  -t     <INT>       Solver threads, overrides the scene's \"threads\"\n");
+  printf("  -b     <INT>       Run this many steps (frames with adaptive_dt) headless at\n");
+  printf("                     1, 2, 4, ... threads (up to -t, default 64) and print a\n");
+  printf("                     scaling report\n");
   exit(-1);
 }
 
@@ -154,6 +164,25 @@ void incompleteObjectError(const char *object, const char *attribute) {
   exit(-1);
 }
 
+void loadObjFile(const string &filename, const Vector3D &origin, vector<Vector3D> &vertices,
+                 vector<uint32_t> &indices) {
+  objl::Loader loader;
+  if (!loader.LoadFile(filename) || loader.LoadedMeshes.empty()) {
+    cout << "Could not load object file: " << filename << endl;
+    exit(-1);
+  }
+
+  // Every mesh in the file goes into one list; face indices refer to the
+  // vertices of their own mesh
+  for (const objl::Mesh &mesh : loader.LoadedMeshes) {
+    uint32_t base = vertices.size();
+    for (auto vertex: mesh.Vertices) {
+      vertices.push_back(Vector3D(vertex.Position.X, vertex.Position.Y, vertex.Position.Z) + origin);
+    }
+    for (unsigned int index : mesh.Indices) indices.push_back(base + index);
+  }
+}
+
 void loadObjectsFromFile(string filename, Fluid *fluid, FluidParameters *cp, vector<CollisionObject *>* objects) {
   // Read JSON from file
   ifstream i(filename);
@@ -210,6 +239,38 @@ void loadObjectsFromFile(string filename, Fluid *fluid, FluidParameters *cp, vec
 
       fluid->radius = radius;
       fluid->friction = friction;
+    } else if (key == SPHERE) {
+      // One sphere, or a list of them
+      json spheres = object.is_array() ? object : json::array({object});
+      for (json sphere : spheres) {
+        Vector3D origin;
+        double radius, friction;
+
+        auto it_origin = sphere.find("origin");
+        if (it_origin != sphere.end()) {
+          vector<double> vec_origin = *it_origin;
+          origin = Vector3D(vec_origin[0], vec_origin[1], vec_origin[2]);
+        } else {
+          incompleteObjectError("sphere", "origin");
+        }
+
+        auto it_radius = sphere.find("radius");
+        if (it_radius != sphere.end()) {
+          radius = *it_radius;
+        } else {
+          incompleteObjectError("sphere", "radius");
+        }
+
+        auto it_friction = sphere.find("friction");
+        if (it_friction != sphere.end()) {
+          friction = *it_friction;
+        } else {
+          incompleteObjectError("sphere", "friction");
+        }
+
+        Sphere *s = new Sphere(origin, radius, friction);
+        objects->push_back(s);
+      }
     } else if (key == TRIANGLE) {
         Vector3D a,b,c;
         double friction;
@@ -257,32 +318,77 @@ void loadObjectsFromFile(string filename, Fluid *fluid, FluidParameters *cp, vec
 
       auto object_file_name = object.find("file");
       if (object_file_name != object.end()) {
-        std::vector<Vector3D *> vertices;
-        std::vector<Triangle *> tris;
         std::string objfilename = object_file_name->get<std::string>();;
-        
-        objl::Loader loader;
-        loader.LoadFile(objfilename);
-
-        objl::Mesh mesh = loader.LoadedMeshes[0];
-        for (auto vertex: mesh.Vertices) {
-          Vector3D *new_v = new Vector3D(vertex.Position.X, vertex.Position.Y, vertex.Position.Z);
-          *new_v = *new_v + ob_origin;
-          vertices.emplace_back(new_v);
-        }
-        for (int j = 0; j < mesh.Indices.size(); j+=3) {
-          Triangle *new_t = new Triangle(*vertices[j],*vertices[j+1],*vertices[j+2],  object_friction);
-          objects->push_back(new_t);
-        }
+        std::vector<Vector3D> vertices;
+        std::vector<uint32_t> indices;
+        loadObjFile(objfilename, ob_origin, vertices, indices);
+        TriangleMesh *collision_mesh = new TriangleMesh(vertices, indices, object_friction);
+        msg("Loaded " << collision_mesh->num_triangles() << " triangles from " << objfilename);
+        objects->push_back(collision_mesh);
       } else {
         incompleteObjectError("Object", "File");
       }
-      //load collada into a list of traingles
-      
-      // insert trinagles into objects
-
 
+    } else if (key == SDF) {
+      // Obstacles baked into signed distance grids, one object or a list
+      json entries = object.is_array() ? object : json::array({object});
+      for (json entry : entries) {
+        double sdf_friction = 0.0;
+        auto it_fric = entry.find("friction");
+        if (it_fric != entry.end()) sdf_friction = *it_fric;
+
+        string shape = "mesh";
+        auto it_shape = entry.find("shape");
+        if (it_shape != entry.end()) shape = it_shape->get<std::string>();
+
+        SDFCollider *sdf;
+        if (shape == "mesh") {
+          int resolution = 64;
+          auto it_res = entry.find("resolution");
+          if (it_res != entry.end()) resolution = *it_res;
+
+          int band = 4;
+          auto it_band = entry.find("band");
+          if (it_band != entry.end()) band = *it_band;
+
+          Vector3D sdf_origin;
+          auto it_origin = entry.find("origin");
+          if (it_origin != entry.end()) {
+            vector<double> vec_origin = *it_origin;
+            sdf_origin = Vector3D(vec_origin[0], vec_origin[1], vec_origin[2]);
+          }
+
+          auto it_file = entry.find("file");
+          if (it_file == entry.end()) incompleteObjectError("sdf", "file");
+          std::vector<Vector3D> vertices;
+          std::vector<uint32_t> indices;
+          loadObjFile(it_file->get<std::string>(), sdf_origin, vertices, indices);
+          sdf = new SDFCollider(vertices, indices, resolution, band, sdf_friction);
+        } else if (shape == "sphere") {
+          auto it_center = entry.find("center");
+          auto it_radius = entry.find("radius");
+          if (it_center == entry.end()) incompleteObjectError("sdf", "center");
+          if (it_radius == entry.end()) incompleteObjectError("sdf", "radius");
+          vector<double> vec_center = *it_center;
+          Vector3D center(vec_center[0], vec_center[1], vec_center[2]);
+          sdf = new SDFCollider(center, (double) *it_radius, sdf_friction);
+        } else if (shape == "box") {
+          auto it_min = entry.find("min");
+          auto it_max = entry.find("max");
+          if (it_min == entry.end()) incompleteObjectError("sdf", "min");
+          if (it_max == entry.end()) incompleteObjectError("sdf", "max");
+          vector<double> vec_min = *it_min;
+          vector<double> vec_max = *it_max;
+          sdf = new SDFCollider(Vector3D(vec_min[0], vec_min[1], vec_min[2]),
+                                Vector3D(vec_max[0], vec_max[1], vec_max[2]), sdf_friction);
+        } else {
+          cout << "Invalid sdf shape: " << shape << endl;
+          exit(-1);
+        }
+        objects->push_back(sdf);
+      }
     } else if (key == BOUNDINGBOX) { // PLANE
+      vector<Plane *> box_planes;
       for (auto plane : object){
         Vector3D point, normal;
         double friction;
@@ -331,7 +437,16 @@ void loadObjectsFromFile(string filename, Fluid *fluid, FluidParameters *cp, vec
         }
 
         Plane *p = new Plane(point, normal, friction);
-        objects->push_back(p);
+        box_planes.push_back(p);
+      }
+
+      // Six axis-aligned planes collapse into one box
+      Container *box = Container::from_planes(box_planes);
+      if (box != NULL) {
+        for (Plane *p : box_planes) delete p;
+        objects->push_back(box);
+      } else {
+        objects->insert(objects->end(), box_planes.begin(), box_planes.end());
       }
     } else if (key == FLUID){
       int num_width_points, num_height_points, num_length_points;
@@ -458,6 +573,11 @@ void loadObjectsFromFile(string filename, Fluid *fluid, FluidParameters *cp, vec
       } else {
         incompleteObjectError("vorticity", "r");
       }
+
+      auto it_color_vor = object.find("color_vorticity");
+      if (it_color_vor != object.end()) {
+        fluid->color_vorticity = *it_color_vor;
+      }
       
       auto it_numberCube = object.find("numberCube");
       if (it_numberCube != object.end()) {
@@ -466,14 +586,219 @@ void loadObjectsFromFile(string filename, Fluid *fluid, FluidParameters *cp, vec
         incompleteObjectError("numberCube", "r");
       }
       
+      auto it_ns = object.find("neighbor_search");
+      if (it_ns != object.end()) {
+        string neighbor_search = *it_ns;
+        if (neighbor_search == "grid") {
+          fluid->neighbor_search = UNIFORM_GRID;
+        } else if (neighbor_search == "kdtree") {
+          fluid->neighbor_search = KDTREE;
+        } else {
+          cout << "Invalid neighbor_search: " << neighbor_search << endl;
+          exit(-1);
+        }
+      }
+
+      auto it_skin = object.find("neighbor_skin");
+      if (it_skin != object.end()) {
+        fluid->neighbor_skin = *it_skin;
+      }
+
+      auto it_reorder = object.find("reorder_interval");
+      if (it_reorder != object.end()) {
+        fluid->reorder_interval = *it_reorder;
+      }
+
+      auto it_pairs = object.find("pair_traversal");
+      if (it_pairs != object.end()) {
+        fluid->pair_traversal = *it_pairs;
+      }
+
+      auto it_solver = object.find("solver");
+      if (it_solver != object.end()) {
+        string solver = *it_solver;
+        if (solver == "pbf") {
+          fluid->solver_type = PBF_SOLVER;
+        } else if (solver == "dfsph") {
+          fluid->solver_type = DFSPH_SOLVER;
+        } else {
+          cout << "Invalid solver: " << solver << endl;
+          exit(-1);
+        }
+      }
+
+      auto it_dfsph_tol = object.find("dfsph_density_tolerance");
+      if (it_dfsph_tol != object.end()) {
+        fluid->dfsph_density_tolerance = *it_dfsph_tol;
+      }
+
+      auto it_dfsph_div_tol = object.find("dfsph_divergence_tolerance");
+      if (it_dfsph_div_tol != object.end()) {
+        fluid->dfsph_divergence_tolerance = *it_dfsph_div_tol;
+      }
+
+      auto it_dfsph_iters = object.find("dfsph_max_iter");
+      if (it_dfsph_iters != object.end()) {
+        fluid->dfsph_max_iters = *it_dfsph_iters;
+      }
+
+      auto it_divergence = object.find("divergence_solve");
+      if (it_divergence != object.end()) {
+        fluid->divergence_solve = *it_divergence;
+      }
+
+      auto it_kernel = object.find("kernel");
+      if (it_kernel != object.end()) {
+        string kernel = *it_kernel;
+        if (kernel == "poly6_spiky") {
+          fluid->kernel_type = POLY6_SPIKY;
+        } else if (kernel == "poly6") {
+          fluid->kernel_type = POLY6;
+        } else if (kernel == "spiky") {
+          fluid->kernel_type = SPIKY;
+        } else if (kernel == "cubic_spline") {
+          fluid->kernel_type = CUBIC_SPLINE;
+        } else if (kernel == "wendland") {
+          fluid->kernel_type = WENDLAND;
+        } else {
+          cout << "Invalid kernel: " << kernel << endl;
+          exit(-1);
+        }
+      }
+
+      auto it_fused = object.find("fused_solver");
+      if (it_fused != object.end()) {
+        fluid->fused_solver = *it_fused;
+      }
+
+      auto it_precision = object.find("precision");
+      if (it_precision != object.end()) {
+        string precision = *it_precision;
+        if (precision == "double") {
+          fluid->single_precision = false;
+        } else if (precision == "float") {
+          fluid->single_precision = true;
+        } else {
+          cout << "Invalid precision: " << precision << endl;
+          exit(-1);
+        }
+      }
+
+      auto it_simd = object.find("simd");
+      if (it_simd != object.end()) {
+        fluid->simd = *it_simd;
+      }
+
+      auto it_tol = object.find("density_tolerance");
+      if (it_tol != object.end()) {
+        fluid->density_tolerance = *it_tol;
+      }
+
+      auto it_tol_norm = object.find("tolerance_norm");
+      if (it_tol_norm != object.end()) {
+        string tolerance_norm = *it_tol_norm;
+        if (tolerance_norm == "mean") {
+          fluid->tolerance_on_max = false;
+        } else if (tolerance_norm == "max") {
+          fluid->tolerance_on_max = true;
+        } else {
+          cout << "Invalid tolerance_norm: " << tolerance_norm << endl;
+          exit(-1);
+        }
+      }
+
+      auto it_min_si = object.find("min_solver_iter");
+      if (it_min_si != object.end()) {
+        fluid->min_solver_iters = *it_min_si;
+      }
+
+      auto it_warm = object.find("warm_start");
+      if (it_warm != object.end()) {
+        fluid->warm_start = *it_warm;
+      }
+
+      auto it_cheb = object.find("chebyshev");
+      if (it_cheb != object.end()) {
+        fluid->chebyshev = *it_cheb;
+      }
+
+      auto it_cheb_rho = object.find("chebyshev_rho");
+      if (it_cheb_rho != object.end()) {
+        fluid->chebyshev_rho = *it_cheb_rho;
+      }
+
+      auto it_cheb_delay = object.find("chebyshev_delay");
+      if (it_cheb_delay != object.end()) {
+        fluid->chebyshev_delay = *it_cheb_delay;
+      }
+
+      auto it_sleeping = object.find("sleeping");
+      if (it_sleeping != object.end()) {
+        fluid->sleeping = *it_sleeping;
+      }
+
+      auto it_sleep_velocity = object.find("sleep_velocity");
+      if (it_sleep_velocity != object.end()) {
+        fluid->sleep_velocity = *it_sleep_velocity;
+      }
+
+      auto it_sleep_error = object.find("sleep_density_error");
+      if (it_sleep_error != object.end()) {
+        fluid->sleep_density_error = *it_sleep_error;
+      }
+
+      auto it_sleep_steps = object.find("sleep_steps");
+      if (it_sleep_steps != object.end()) {
+        fluid->sleep_steps = *it_sleep_steps;
+      }
+
+      auto it_broad_phase = object.find("broad_phase");
+      if (it_broad_phase != object.end()) {
+        fluid->broad_phase = *it_broad_phase;
+      }
+
+      auto it_log_solver = object.find("log_solver");
+      if (it_log_solver != object.end()) {
+        fluid->log_solver = *it_log_solver;
+      }
+
+      auto it_adaptive = object.find("adaptive_dt");
+      if (it_adaptive != object.end()) {
+        fluid->adaptive_dt = *it_adaptive;
+      }
+
+      auto it_cfl = object.find("cfl");
+      if (it_cfl != object.end()) {
+        fluid->cfl = *it_cfl;
+      }
+
+      auto it_min_dt = object.find("min_dt");
+      if (it_min_dt != object.end()) {
+        fluid->min_dt = *it_min_dt;
+      }
+
+      auto it_max_dt = object.find("max_dt");
+      if (it_max_dt != object.end()) {
+        fluid->max_dt = *it_max_dt;
+      }
+
+      auto it_threads = object.find("threads");
+      if (it_threads != object.end()) {
+        fluid->threads = *it_threads;
+      }
+
       fluid->maxBoundaries = maxBoundaries + 1.0;
       fluid->minBoundaries = minBoundaries - 1.0;
 
 
 
+      // Only the fused sweeps have a float version
+      if (fluid->single_precision && (!fluid->fused_solver || fluid->pair_traversal)) {
+        cout << "precision \"float\" needs fused_solver on and pair_traversal off, using double" << endl;
+        fluid->single_precision = false;
+      }
+
       fluid->R = R;
-      fluid->W_CONSTANT =  315.0/(64.0*PI*pow(R,9));
-      fluid->W_DEL_CONSTANT = 45.0/(PI*pow(R,6)); //TODO this maybe negated
 
       fluid->num_width_points = num_width_points;
       fluid->num_height_points = num_height_points;
@@ -497,10 +822,59 @@ void loadObjectsFromFile(string filename, Fluid *fluid, FluidParameters *cp, vec
   i.close();
 }
 
+void runBenchmark(Fluid *fluid, vector<CollisionObject *> *objects, int steps) {
+  // Same scene and step count at each thread count, without the voxel export
+  // or particle colours
+  int max_threads = fluid->threads > 0 ? fluid->threads : 64;
+  vector<int> thread_counts;
+  for (int t = 1; t < max_threads; t *= 2) thread_counts.push_back(t);
+  thread_counts.push_back(max_threads);
+
+  fluid->export_voxels = false;
+  fluid->color_vorticity = false;
+  fluid->buildGrid();
+  vector<Vector3D> external_accelerations = {Vector3D(0, -9.8, 0)};
+
+  printf("%s solver, %zu particles, %d %s, %d solver iterations, %s precision, %s sweeps\n",
+         fluid->solver->name(), fluid->particles.size(), steps,
+         fluid->adaptive_dt ? "adaptive frames" : "steps", fluid->solver_iters,
+         fluid->fused_solver && fluid->single_precision ? "float" : "double",
+         fluid->fused_solver && fluid->simd_fused_sweeps() ? simd_name(fluid->simd_isa) : "scalar");
+  // Both modes advance 1/fps of simulated time per simulate call
+  double simulated = (double) steps / fluid->fps;
+  // Past the core count threads only share cores, so those rows say
+  // nothing about scaling
+  if (max_threads > num_procs()) {
+    printf("only %d processors available, rows above %d threads are oversubscribed\n",
+           num_procs(), num_procs());
+  }
+  printf("threads    ms/step  speedup  efficiency  sim s/s  density error\n");
+  double base_ms = 0;
+  for (int t : thread_counts) {
+    set_num_threads(t);
+    fluid->reset();
+    auto start = chrono::steady_clock::now();
+    for (int s = 0; s < steps; s++) {
+      if (fluid->adaptive_dt) {
+        fluid->simulate_frame(fluid->fps, external_accelerations, objects, s);
+      } else {
+        fluid->simulate(fluid->fps, 1, NULL, external_accelerations, objects, s);
+      }
+    }
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    double ms = elapsed.count() / steps;
+    if (t == 1) base_ms = ms;
+    printf("%7d %10.2f %8.2f %11.2f %8.3f %14.6f\n", t, ms, base_ms / ms, base_ms / ms / t,
+           simulated / (elapsed.count() / 1000), fluid->mean_density_error());
+  }
+}
+
 int main(int argc, char **argv) {
   Fluid fluid;
   FluidParameters fp;
   vector<CollisionObject *> objects;
+  int threads = 0;
+  int benchmark_steps = 0;
 
   if (argc == 1) { // No arguments, default initialization
     // string default_file_name = "../scene/pinned2.json";
@@ -508,17 +882,31 @@ int main(int argc, char **argv) {
   } else {
     int c;
 
-    while ((c = getopt (argc, argv, "f:")) != -1) {
+    while ((c = getopt (argc, argv, "f:t:b:")) != -1) {
       switch (c) {
         case 'f':
           loadObjectsFromFile(optarg, &fluid, &fp, &objects);
           break;
+        case 't':
+          threads = atoi(optarg);
+          break;
+        case 'b':
+          benchmark_steps = atoi(optarg);
+          break;
         default:
           usageError(argv[0]);
       }
     }
   }
 
+  if (threads > 0) fluid.threads = threads;
+
+  if (benchmark_steps > 0) {
+    runBenchmark(&fluid, &objects, benchmark_steps);
+    return 0;
+  }
+  set_num_threads(fluid.threads);
+
   glfwSetErrorCallback(error_callback);
 
   createGLContexts();
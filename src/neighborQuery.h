@@ -0,0 +1,67 @@
+#ifndef FLUID_NEIGHBOR_QUERY_H
+#define FLUID_NEIGHBOR_QUERY_H
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "neighborTable.h"
+#include "parallel.h"
+
+using namespace std;
+
+/*
+  Runs a batch of independent neighbor queries in parallel and collects the
+  results into one NeighborTable.
+
+  Queries are cut into one contiguous chunk per thread. Each chunk fills its
+  own CSR scratch table, then the chunks are copied into the output at their
+  prefix-summed offsets, so the output is in query order whatever the thread
+  count. The scratch tables are kept between calls.
+*/
+struct NeighborQuery {
+  struct Chunk {
+    NeighborTable table;
+    vector<pair<size_t, double>> matches;
+  };
+
+  // search(q, matches) must fill matches for query q; it is called
+  // concurrently from several threads
+  template <typename Search>
+  void run(size_t n, Search search, NeighborTable &out) {
+    long num_chunks = num_threads();
+    if ((size_t) num_chunks > n) num_chunks = n > 0 ? n : 1;
+    chunks.resize(num_chunks);
+
+    #pragma omp parallel for schedule(static, 1)
+    for (long c = 0; c < num_chunks; c++) {
+      Chunk &chunk = chunks[c];
+      chunk.table.clear();
+      for (size_t q = n * c / num_chunks; q < n * (c + 1) / num_chunks; q++) {
+        search(q, chunk.matches);
+        for (auto &match : chunk.matches) chunk.table.indices.push_back(match.first);
+        chunk.table.end_particle();
+      }
+    }
+
+    vector<size_t> base(num_chunks + 1, 0);
+    for (long c = 0; c < num_chunks; c++) {
+      base[c + 1] = base[c] + chunks[c].table.indices.size();
+    }
+    out.offsets.resize(n + 1);
+    out.indices.resize(base[num_chunks]);
+    out.offsets[0] = 0;
+
+    #pragma omp parallel for schedule(static, 1)
+    for (long c = 0; c < num_chunks; c++) {
+      const NeighborTable &t = chunks[c].table;
+      size_t first = n * c / num_chunks;
+      for (size_t k = 0; k < t.size(); k++) out.offsets[first + k + 1] = base[c] + t.offsets[k + 1];
+      copy(t.indices.begin(), t.indices.end(), out.indices.begin() + base[c]);
+    }
+  }
+
+  vector<Chunk> chunks;
+};
+
+#endif /* FLUID_NEIGHBOR_QUERY_H */
@@ -0,0 +1,62 @@
+#ifndef FLUID_NEIGHBOR_TABLE_H
+#define FLUID_NEIGHBOR_TABLE_H
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/*
+  Compressed-sparse-row neighbor lists. The neighbors of particle i are
+  indices[offsets[i]] .. indices[offsets[i+1]-1]. Fluid keeps one table alive
+  across steps so rebuilding it reuses the previous allocation.
+*/
+struct NeighborTable {
+  struct Range {
+    const uint32_t *first;
+    const uint32_t *last;
+    const uint32_t *begin() const { return first; }
+    const uint32_t *end() const { return last; }
+    size_t size() const { return last - first; }
+  };
+
+  // Empties the table while keeping its capacity
+  void clear() {
+    offsets.assign(1, 0);
+    indices.clear();
+  }
+
+  // Appends the list of the next particle; call in particle order
+  void end_particle() { offsets.push_back(indices.size()); }
+
+  size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+  // Renumbers particles: list i becomes the list of order[i], and every
+  // entry j becomes new_index[j]. order may cover more particles than the
+  // table has lists, as long as its first size() entries are all below size().
+  void permute(const vector<uint32_t> &order, const vector<uint32_t> &new_index) {
+    vector<uint32_t> new_offsets(1, 0), new_indices;
+    new_offsets.reserve(offsets.size());
+    new_indices.reserve(indices.size());
+    for (size_t i = 0; i < size(); i++) {
+      uint32_t old = order[i];
+      for (uint32_t k = offsets[old]; k < offsets[old + 1]; k++) {
+        new_indices.push_back(new_index[indices[k]]);
+      }
+      new_offsets.push_back(new_indices.size());
+    }
+    offsets.swap(new_offsets);
+    indices.swap(new_indices);
+  }
+
+  Range operator[](size_t i) const {
+    const uint32_t *base = indices.data();
+    Range r = {base + offsets[i], base + offsets[i + 1]};
+    return r;
+  }
+
+  vector<uint32_t> offsets;
+  vector<uint32_t> indices;
+};
+
+#endif /* FLUID_NEIGHBOR_TABLE_H */
@@ -0,0 +1,125 @@
+#ifndef FLUID_PARALLEL_H
+#define FLUID_PARALLEL_H
+
+#include <algorithm>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+// Thin wrappers so the solver also builds without OpenMP
+inline int num_threads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+// n <= 0 leaves the OpenMP default (OMP_NUM_THREADS or one per core)
+inline void set_num_threads(int n) {
+#ifdef _OPENMP
+  if (n > 0) omp_set_num_threads(n);
+#endif
+}
+
+// Processors the OpenMP runtime can use
+inline int num_procs() {
+#ifdef _OPENMP
+  return omp_get_num_procs();
+#else
+  return 1;
+#endif
+}
+
+inline int thread_id() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+// Contiguous block [begin, end) of n items for the calling thread of a
+// parallel region, split the way schedule(static) would split them
+inline void thread_block(long n, long &begin, long &end) {
+#ifdef _OPENMP
+  long threads = omp_get_num_threads(), t = omp_get_thread_num();
+#else
+  long threads = 1, t = 0;
+#endif
+  long chunk = n/threads, extra = n%threads;
+  begin = t*chunk + (t < extra ? t : extra);
+  end = begin + chunk + (t < extra ? 1 : 0);
+}
+
+/*
+  Per-thread buffers for sweeps that scatter into two particles at once.
+  A thread working through its static block [begin, end) scatters from i
+  into i and neighbors j > i only, so what it writes is a window of indices
+  that starts at begin and grows as it goes. Each thread zeroes its own
+  window as it grows, inside the parallel region, and the fold afterwards
+  only looks at the windows that reach into its block, instead of clearing
+  and summing every thread's buffer over all n particles.
+*/
+template <typename T>
+struct ThreadAccumulator {
+  struct Window {
+    T &operator[](size_t i) {
+      if (i >= end) {
+        fill(data.begin() + end, data.begin() + i + 1, T());
+        end = i + 1;
+      }
+      return data[i];
+    }
+
+    vector<T> data;
+    size_t begin = 0, end = 0;
+    char pad[64];  // keeps the threads' window bounds on separate cache lines
+  };
+
+  // Windows that reach into one thread's block, for folding it
+  struct Block {
+    T sum(size_t i) const {
+      T s = T();
+      for (const Window *w : windows) {
+        if (w->begin <= i && i < w->end) s += w->data[i];
+      }
+      return s;
+    }
+
+    vector<const Window *> windows;
+  };
+
+  // Before the parallel region: one empty window per thread
+  void reset(size_t n) {
+    size = n;
+    windows.resize(num_threads());
+    for (Window &w : windows) w.begin = w.end = 0;
+  }
+
+  // The calling thread's window, opened empty at the start of its block
+  Window &local(size_t begin) {
+    Window &w = windows[thread_id()];
+    if (w.data.size() < size) w.data.resize(size);
+    w.begin = w.end = begin;
+    return w;
+  }
+
+  // Once every thread has scattered
+  Block block(size_t begin, size_t end) const {
+    Block b;
+    for (const Window &w : windows) {
+      if (w.begin < end && begin < w.end) b.windows.push_back(&w);
+    }
+    return b;
+  }
+
+  size_t size = 0;
+  vector<Window> windows;
+};
+
+#endif /* FLUID_PARALLEL_H */
@@ -0,0 +1,107 @@
+#ifndef FLUID_PARTICLE_STORE_H
+#define FLUID_PARTICLE_STORE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "CGL/CGL.h"
+#include "collision/particle.h"
+#include "vec3.h"
+
+using namespace CGL;
+using namespace std;
+
+/*
+  Structure-of-arrays storage for the fluid's particles.
+
+  The neighbor sweeps read x_star and lambda and write delta_p, so those live
+  in their own contiguous arrays; per-step state and bookkeeping that only
+  the O(n) passes touch sit in separate arrays behind them. operator[] hands
+  out a ParticleRef for code that wants one particle at a time.
+*/
+struct ParticleStore {
+  // Hot: touched by every neighbor sweep
+  vector<Vector3D> x_star;
+  vector<double> lambda;
+  vector<Vector3D> delta_p;
+
+  // Per-step state
+  vector<Vector3D> origin;
+  vector<Vector3D> velocity;
+  vector<double> density;
+  vector<Vector3D> omega;
+  vector<Vector3D> forces;
+
+  // Cold: reset, rendering and export
+  vector<Vector3D> last_origin;
+  vector<Vector3D> start_origin;
+  vector<Vector3D> color;
+  vector<uint32_t> id; // seeding order, kept across reorders
+
+  // Float copies of x_star and lambda that the single-precision sweeps
+  // read neighbors from. Fluid::refresh_float_mirror() rebuilds them before
+  // use, so add(), clear() and permute() leave them alone.
+  vector<Vec3<float>> x_star_f;
+  vector<float> lambda_f;
+
+  // Shared by every particle of the fluid
+  double radius = 0;
+  double friction = 0;
+
+  size_t size() const { return x_star.size(); }
+  bool empty() const { return x_star.empty(); }
+
+  void add(const Vector3D &pos, const Vector3D &vel) {
+    id.push_back(x_star.size());
+    x_star.push_back(pos);
+    lambda.push_back(0);
+    delta_p.push_back(Vector3D());
+    origin.push_back(pos);
+    velocity.push_back(vel);
+    density.push_back(0);
+    omega.push_back(Vector3D());
+    forces.push_back(Vector3D());
+    last_origin.push_back(pos);
+    start_origin.push_back(pos);
+    color.push_back(Vector3D());
+  }
+
+  void clear() {
+    x_star.clear(); lambda.clear(); delta_p.clear();
+    origin.clear(); velocity.clear(); density.clear(); omega.clear(); forces.clear();
+    last_origin.clear(); start_origin.clear(); color.clear(); id.clear();
+  }
+
+  // Moves particle order[i] to slot i in every array
+  void permute(const vector<uint32_t> &order) {
+    permute_array(x_star, order);
+    permute_array(lambda, order);
+    permute_array(delta_p, order);
+    permute_array(origin, order);
+    permute_array(velocity, order);
+    permute_array(density, order);
+    permute_array(omega, order);
+    permute_array(forces, order);
+    permute_array(last_origin, order);
+    permute_array(start_origin, order);
+    permute_array(color, order);
+    permute_array(id, order);
+  }
+
+  ParticleRef operator[](size_t i) {
+    ParticleRef p = {origin[i], last_origin[i], start_origin[i], color[i],
+                     x_star[i], density[i], delta_p[i], forces[i], omega[i],
+                     velocity[i], lambda[i], id[i], radius, friction};
+    return p;
+  }
+
+  template <typename T>
+  static void permute_array(vector<T> &a, const vector<uint32_t> &order) {
+    vector<T> b;
+    b.reserve(a.size());
+    for (uint32_t old : order) b.push_back(a[old]);
+    a.swap(b);
+  }
+};
+
+#endif /* FLUID_PARTICLE_STORE_H */
@@ -0,0 +1,559 @@
+#include <algorithm>
+
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FLUID_SIMD_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Positions are gathered as a flat double array, three per particle
+static_assert(sizeof(Vector3D) == 3 * sizeof(double), "Vector3D must be three packed doubles");
+static_assert(sizeof(Vec3<float>) == 3 * sizeof(float), "Vec3<float> must be three packed floats");
+
+e_simd detect_simd() {
+#ifdef FLUID_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMD_AVX2;
+#endif
+  return SIMD_SCALAR;
+}
+
+const char *simd_name(e_simd isa) {
+  switch (isa) {
+    case SIMD_AVX2: return "avx2";
+    case SIMD_AVX512: return "avx512";
+    default: return "scalar";
+  }
+}
+
+#ifdef FLUID_SIMD_X86
+
+// ====================================AVX2=========================================
+
+__attribute__((target("avx2,fma")))
+static inline double hsum_avx2(__m256d v) {
+  __m128d lo = _mm256_castpd256_pd128(v);
+  __m128d hi = _mm256_extractf128_pd(v, 1);
+  lo = _mm_add_pd(lo, hi);
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+// Lanes [0, count) of a batch of four
+__attribute__((target("avx2,fma")))
+static inline __m128i lanes_avx2(int count) {
+  return _mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(count));
+}
+
+__attribute__((target("avx2,fma")))
+static void lambdas_avx2(const FusedSweep &s, const Poly6<double> &poly6, const Spiky<double> &spiky) {
+  const double *x = &s.x_star[0].x;
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d p6_h2 = _mm256_set1_pd(poly6.h2);
+  const __m256d p6_c_W = _mm256_set1_pd(poly6.c_W);
+  const __m256d sp_h = _mm256_set1_pd(spiky.h);
+  const __m256d sp_h2 = _mm256_set1_pd(spiky.h2);
+  const __m256d sp_c_grad = _mm256_set1_pd(spiky.c_grad);
+  const __m128i three = _mm_set1_epi32(3);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < s.n; i++) {
+    const __m256d xi = _mm256_set1_pd(s.x_star[i].x);
+    const __m256d yi = _mm256_set1_pd(s.x_star[i].y);
+    const __m256d zi = _mm256_set1_pd(s.x_star[i].z);
+    __m256d rho = zero, gx_sum = zero, gy_sum = zero, gz_sum = zero, g2_sum = zero;
+
+    uint32_t last = s.offsets[i + 1];
+    for (uint32_t k = s.offsets[i]; k < last; k += 4) {
+      __m128i active = lanes_avx2(min(4u, last - k));
+      __m256d mask = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(active));
+      __m128i j = _mm_maskload_epi32((const int *) (s.indices + k), active);
+      __m128i j3 = _mm_mullo_epi32(j, three);
+
+      __m256d rx = _mm256_sub_pd(xi, _mm256_mask_i32gather_pd(zero, x, j3, mask, 8));
+      __m256d ry = _mm256_sub_pd(yi, _mm256_mask_i32gather_pd(zero, x + 1, j3, mask, 8));
+      __m256d rz = _mm256_sub_pd(zi, _mm256_mask_i32gather_pd(zero, x + 2, j3, mask, 8));
+      __m256d r2 = _mm256_fmadd_pd(rx, rx, _mm256_fmadd_pd(ry, ry, _mm256_mul_pd(rz, rz)));
+
+      // Poly6 value
+      __m256d d = _mm256_sub_pd(p6_h2, r2);
+      __m256d w = _mm256_mul_pd(p6_c_W, _mm256_mul_pd(d, _mm256_mul_pd(d, d)));
+      w = _mm256_and_pd(w, _mm256_and_pd(mask, _mm256_cmp_pd(r2, p6_h2, _CMP_LT_OQ)));
+
+      // Spiky gradient; the self pair (r2 == 0) is masked out with the tail
+      __m256d r = _mm256_sqrt_pd(r2);
+      __m256d e = _mm256_sub_pd(sp_h, r);
+      __m256d gs = _mm256_div_pd(_mm256_mul_pd(sp_c_grad, _mm256_mul_pd(e, e)), r);
+      __m256d g_mask = _mm256_and_pd(_mm256_cmp_pd(r2, sp_h2, _CMP_LT_OQ),
+                                     _mm256_cmp_pd(r2, zero, _CMP_GT_OQ));
+      gs = _mm256_and_pd(gs, _mm256_and_pd(mask, g_mask));
+      __m256d gx = _mm256_mul_pd(gs, rx);
+      __m256d gy = _mm256_mul_pd(gs, ry);
+      __m256d gz = _mm256_mul_pd(gs, rz);
+
+      __m256i store_mask = _mm256_castpd_si256(mask);
+      _mm256_maskstore_pd(s.W + k, store_mask, w);
+      _mm256_maskstore_pd(s.del_W_x + k, store_mask, gx);
+      _mm256_maskstore_pd(s.del_W_y + k, store_mask, gy);
+      _mm256_maskstore_pd(s.del_W_z + k, store_mask, gz);
+
+      rho = _mm256_add_pd(rho, w);
+      gx_sum = _mm256_add_pd(gx_sum, gx);
+      gy_sum = _mm256_add_pd(gy_sum, gy);
+      gz_sum = _mm256_add_pd(gz_sum, gz);
+      g2_sum = _mm256_fmadd_pd(gx, gx, _mm256_fmadd_pd(gy, gy, _mm256_fmadd_pd(gz, gz, g2_sum)));
+    }
+
+    double density = hsum_avx2(rho);
+    Vector3D del_i = Vector3D(hsum_avx2(gx_sum), hsum_avx2(gy_sum), hsum_avx2(gz_sum))/s.rho0;
+    double del_j = hsum_avx2(g2_sum)/(s.rho0*s.rho0);
+    s.density[i] = density;
+    s.lambda[i] = -(density/s.rho0 - 1.0)/(del_j + del_i.norm2() + s.epsilon);
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void delta_p_avx2(const FusedSweep &s) {
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d inv_W_dq = _mm256_set1_pd(s.scorr_inv_W);
+  const __m256d k_corr = _mm256_set1_pd(-0.001);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < s.n; i++) {
+    const __m256d li = _mm256_set1_pd(s.lambda[i]);
+    __m256d dx = zero, dy = zero, dz = zero;
+
+    uint32_t last = s.offsets[i + 1];
+    for (uint32_t k = s.offsets[i]; k < last; k += 4) {
+      __m128i active = lanes_avx2(min(4u, last - k));
+      __m256d mask = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(active));
+      __m256i load_mask = _mm256_castpd_si256(mask);
+      __m128i j = _mm_maskload_epi32((const int *) (s.indices + k), active);
+
+      __m256d w = _mm256_maskload_pd(s.W + k, load_mask);
+      __m256d lj = _mm256_mask_i32gather_pd(zero, s.lambda, j, mask, 8);
+      __m256d q = _mm256_mul_pd(w, inv_W_dq);
+      q = _mm256_mul_pd(q, q);
+      __m256d coef = _mm256_add_pd(_mm256_add_pd(li, lj), _mm256_mul_pd(k_corr, _mm256_mul_pd(q, q)));
+
+      dx = _mm256_fmadd_pd(coef, _mm256_maskload_pd(s.del_W_x + k, load_mask), dx);
+      dy = _mm256_fmadd_pd(coef, _mm256_maskload_pd(s.del_W_y + k, load_mask), dy);
+      dz = _mm256_fmadd_pd(coef, _mm256_maskload_pd(s.del_W_z + k, load_mask), dz);
+    }
+
+    s.delta_p[i] = Vector3D(hsum_avx2(dx), hsum_avx2(dy), hsum_avx2(dz))/s.rho0;
+  }
+}
+
+// Float lanes are summed in double
+__attribute__((target("avx2,fma")))
+static inline double hsum_avx2(__m256 v) {
+  return hsum_avx2(_mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)),
+                                 _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1))));
+}
+
+// Lanes [0, count) of a batch of eight
+__attribute__((target("avx2,fma")))
+static inline __m256i lanes8_avx2(int count) {
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32(count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+/*
+  x, y and z of the particles j[0..8), read from the packed float mirror with
+  one 16-byte load each and transposed; the fourth float of a load belongs
+  to the next particle and is dropped. Cheaper than three gathers.
+*/
+__attribute__((target("avx2,fma")))
+static inline void load_positions_avx2(const float *x, const uint32_t *j,
+                                       __m256 &px, __m256 &py, __m256 &pz) {
+  __m256 v0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(x + 3*j[0])), _mm_loadu_ps(x + 3*j[4]), 1);
+  __m256 v1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(x + 3*j[1])), _mm_loadu_ps(x + 3*j[5]), 1);
+  __m256 v2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(x + 3*j[2])), _mm_loadu_ps(x + 3*j[6]), 1);
+  __m256 v3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(x + 3*j[3])), _mm_loadu_ps(x + 3*j[7]), 1);
+  __m256 t0 = _mm256_unpacklo_ps(v0, v1);
+  __m256 t1 = _mm256_unpackhi_ps(v0, v1);
+  __m256 t2 = _mm256_unpacklo_ps(v2, v3);
+  __m256 t3 = _mm256_unpackhi_ps(v2, v3);
+  px = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+  py = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+  pz = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+}
+
+__attribute__((target("avx2,fma")))
+static void lambdas_avx2(const FusedSweepF &s, const Poly6<float> &poly6, const Spiky<float> &spiky) {
+  const float *x = &s.x_star[0].x;
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 p6_h2 = _mm256_set1_ps(poly6.h2);
+  const __m256 p6_c_W = _mm256_set1_ps(poly6.c_W);
+  const __m256 sp_h = _mm256_set1_ps(spiky.h);
+  const __m256 sp_h2 = _mm256_set1_ps(spiky.h2);
+  const __m256 sp_c_grad = _mm256_set1_ps(spiky.c_grad);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < s.n; i++) {
+    alignas(32) uint32_t j[8];
+    const __m256 xi = _mm256_set1_ps(s.x_star[i].x);
+    const __m256 yi = _mm256_set1_ps(s.x_star[i].y);
+    const __m256 zi = _mm256_set1_ps(s.x_star[i].z);
+    __m256 rho = zero, gx_sum = zero, gy_sum = zero, gz_sum = zero, g2_sum = zero;
+
+    uint32_t last = s.offsets[i + 1];
+    for (uint32_t k = s.offsets[i]; k < last; k += 8) {
+      __m256i active = lanes8_avx2(min(8u, last - k));
+      __m256 mask = _mm256_castsi256_ps(active);
+      _mm256_store_si256((__m256i *) j, _mm256_maskload_epi32((const int *) (s.indices + k), active));
+
+      __m256 px, py, pz;
+      load_positions_avx2(x, j, px, py, pz);
+      __m256 rx = _mm256_sub_ps(xi, px);
+      __m256 ry = _mm256_sub_ps(yi, py);
+      __m256 rz = _mm256_sub_ps(zi, pz);
+      __m256 r2 = _mm256_fmadd_ps(rx, rx, _mm256_fmadd_ps(ry, ry, _mm256_mul_ps(rz, rz)));
+
+      // Poly6 value
+      __m256 d = _mm256_sub_ps(p6_h2, r2);
+      __m256 w = _mm256_mul_ps(p6_c_W, _mm256_mul_ps(d, _mm256_mul_ps(d, d)));
+      w = _mm256_and_ps(w, _mm256_and_ps(mask, _mm256_cmp_ps(r2, p6_h2, _CMP_LT_OQ)));
+
+      // Spiky gradient; the self pair (r2 == 0) is masked out with the tail
+      __m256 r = _mm256_sqrt_ps(r2);
+      __m256 e = _mm256_sub_ps(sp_h, r);
+      __m256 gs = _mm256_div_ps(_mm256_mul_ps(sp_c_grad, _mm256_mul_ps(e, e)), r);
+      __m256 g_mask = _mm256_and_ps(_mm256_cmp_ps(r2, sp_h2, _CMP_LT_OQ),
+                                    _mm256_cmp_ps(r2, zero, _CMP_GT_OQ));
+      gs = _mm256_and_ps(gs, _mm256_and_ps(mask, g_mask));
+      __m256 gx = _mm256_mul_ps(gs, rx);
+      __m256 gy = _mm256_mul_ps(gs, ry);
+      __m256 gz = _mm256_mul_ps(gs, rz);
+
+      _mm256_maskstore_ps(s.W + k, active, w);
+      _mm256_maskstore_ps(s.del_W_x + k, active, gx);
+      _mm256_maskstore_ps(s.del_W_y + k, active, gy);
+      _mm256_maskstore_ps(s.del_W_z + k, active, gz);
+
+      rho = _mm256_add_ps(rho, w);
+      gx_sum = _mm256_add_ps(gx_sum, gx);
+      gy_sum = _mm256_add_ps(gy_sum, gy);
+      gz_sum = _mm256_add_ps(gz_sum, gz);
+      g2_sum = _mm256_fmadd_ps(gx, gx, _mm256_fmadd_ps(gy, gy, _mm256_fmadd_ps(gz, gz, g2_sum)));
+    }
+
+    double density = hsum_avx2(rho);
+    Vector3D del_i = Vector3D(hsum_avx2(gx_sum), hsum_avx2(gy_sum), hsum_avx2(gz_sum))/s.rho0;
+    double del_j = hsum_avx2(g2_sum)/(s.rho0*s.rho0);
+    double lambda = -(density/s.rho0 - 1.0)/(del_j + del_i.norm2() + s.epsilon);
+    s.density[i] = density;
+    s.lambda[i] = lambda;
+    s.lambda_f[i] = lambda;
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void delta_p_avx2(const FusedSweepF &s) {
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 inv_W_dq = _mm256_set1_ps(s.scorr_inv_W);
+  const __m256 k_corr = _mm256_set1_ps(-0.001f);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < s.n; i++) {
+    const __m256 li = _mm256_set1_ps(s.lambda_f[i]);
+    __m256 dx = zero, dy = zero, dz = zero;
+
+    uint32_t last = s.offsets[i + 1];
+    for (uint32_t k = s.offsets[i]; k < last; k += 8) {
+      __m256i active = lanes8_avx2(min(8u, last - k));
+      __m256 mask = _mm256_castsi256_ps(active);
+      __m256i j = _mm256_maskload_epi32((const int *) (s.indices + k), active);
+
+      __m256 w = _mm256_maskload_ps(s.W + k, active);
+      __m256 lj = _mm256_mask_i32gather_ps(zero, s.lambda_f, j, mask, 4);
+      __m256 q = _mm256_mul_ps(w, inv_W_dq);
+      q = _mm256_mul_ps(q, q);
+      __m256 coef = _mm256_add_ps(_mm256_add_ps(li, lj), _mm256_mul_ps(k_corr, _mm256_mul_ps(q, q)));
+
+      dx = _mm256_fmadd_ps(coef, _mm256_maskload_ps(s.del_W_x + k, active), dx);
+      dy = _mm256_fmadd_ps(coef, _mm256_maskload_ps(s.del_W_y + k, active), dy);
+      dz = _mm256_fmadd_ps(coef, _mm256_maskload_ps(s.del_W_z + k, active), dz);
+    }
+
+    s.delta_p[i] = Vector3D(hsum_avx2(dx), hsum_avx2(dy), hsum_avx2(dz))/s.rho0;
+  }
+}
+
+// ===================================AVX-512=======================================
+
+__attribute__((target("avx512f")))
+static void lambdas_avx512(const FusedSweep &s, const Poly6<double> &poly6, const Spiky<double> &spiky) {
+  const double *x = &s.x_star[0].x;
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512d p6_h2 = _mm512_set1_pd(poly6.h2);
+  const __m512d p6_c_W = _mm512_set1_pd(poly6.c_W);
+  const __m512d sp_h = _mm512_set1_pd(spiky.h);
+  const __m512d sp_h2 = _mm512_set1_pd(spiky.h2);
+  const __m512d sp_c_grad = _mm512_set1_pd(spiky.c_grad);
+  const __m256i three = _mm256_set1_epi32(3);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < s.n; i++) {
+    const __m512d xi = _mm512_set1_pd(s.x_star[i].x);
+    const __m512d yi = _mm512_set1_pd(s.x_star[i].y);
+    const __m512d zi = _mm512_set1_pd(s.x_star[i].z);
+    __m512d rho = zero, gx_sum = zero, gy_sum = zero, gz_sum = zero, g2_sum = zero;
+
+    uint32_t last = s.offsets[i + 1];
+    for (uint32_t k = s.offsets[i]; k < last; k += 8) {
+      __mmask8 mask = (__mmask8) ((1u << min(8u, last - k)) - 1);
+      __m256i j = _mm512_castsi512_si256(_mm512_maskz_loadu_epi32(mask, s.indices + k));
+      __m256i j3 = _mm256_mullo_epi32(j, three);
+
+      __m512d rx = _mm512_sub_pd(xi, _mm512_mask_i32gather_pd(zero, mask, j3, x, 8));
+      __m512d ry = _mm512_sub_pd(yi, _mm512_mask_i32gather_pd(zero, mask, j3, x + 1, 8));
+      __m512d rz = _mm512_sub_pd(zi, _mm512_mask_i32gather_pd(zero, mask, j3, x + 2, 8));
+      __m512d r2 = _mm512_fmadd_pd(rx, rx, _mm512_fmadd_pd(ry, ry, _mm512_mul_pd(rz, rz)));
+
+      // Poly6 value
+      __mmask8 w_mask = _mm512_mask_cmp_pd_mask(mask, r2, p6_h2, _CMP_LT_OQ);
+      __m512d d = _mm512_sub_pd(p6_h2, r2);
+      __m512d w = _mm512_maskz_mul_pd(w_mask, p6_c_W, _mm512_mul_pd(d, _mm512_mul_pd(d, d)));
+
+      // Spiky gradient; the self pair (r2 == 0) is masked out with the tail
+      __mmask8 g_mask = _mm512_mask_cmp_pd_mask(mask, r2, sp_h2, _CMP_LT_OQ) &
+                        _mm512_cmp_pd_mask(r2, zero, _CMP_GT_OQ);
+      __m512d r = _mm512_sqrt_pd(r2);
+      __m512d e = _mm512_sub_pd(sp_h, r);
+      __m512d gs = _mm512_maskz_div_pd(g_mask, _mm512_mul_pd(sp_c_grad, _mm512_mul_pd(e, e)), r);
+      __m512d gx = _mm512_mul_pd(gs, rx);
+      __m512d gy = _mm512_mul_pd(gs, ry);
+      __m512d gz = _mm512_mul_pd(gs, rz);
+
+      _mm512_mask_storeu_pd(s.W + k, mask, w);
+      _mm512_mask_storeu_pd(s.del_W_x + k, mask, gx);
+      _mm512_mask_storeu_pd(s.del_W_y + k, mask, gy);
+      _mm512_mask_storeu_pd(s.del_W_z + k, mask, gz);
+
+      rho = _mm512_add_pd(rho, w);
+      gx_sum = _mm512_add_pd(gx_sum, gx);
+      gy_sum = _mm512_add_pd(gy_sum, gy);
+      gz_sum = _mm512_add_pd(gz_sum, gz);
+      g2_sum = _mm512_fmadd_pd(gx, gx, _mm512_fmadd_pd(gy, gy, _mm512_fmadd_pd(gz, gz, g2_sum)));
+    }
+
+    double density = _mm512_reduce_add_pd(rho);
+    Vector3D del_i = Vector3D(_mm512_reduce_add_pd(gx_sum), _mm512_reduce_add_pd(gy_sum),
+                              _mm512_reduce_add_pd(gz_sum))/s.rho0;
+    double del_j = _mm512_reduce_add_pd(g2_sum)/(s.rho0*s.rho0);
+    s.density[i] = density;
+    s.lambda[i] = -(density/s.rho0 - 1.0)/(del_j + del_i.norm2() + s.epsilon);
+  }
+}
+
+__attribute__((target("avx512f")))
+static void delta_p_avx512(const FusedSweep &s) {
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512d inv_W_dq = _mm512_set1_pd(s.scorr_inv_W);
+  const __m512d k_corr = _mm512_set1_pd(-0.001);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < s.n; i++) {
+    const __m512d li = _mm512_set1_pd(s.lambda[i]);
+    __m512d dx = zero, dy = zero, dz = zero;
+
+    uint32_t last = s.offsets[i + 1];
+    for (uint32_t k = s.offsets[i]; k < last; k += 8) {
+      __mmask8 mask = (__mmask8) ((1u << min(8u, last - k)) - 1);
+      __m256i j = _mm512_castsi512_si256(_mm512_maskz_loadu_epi32(mask, s.indices + k));
+
+      __m512d w = _mm512_maskz_loadu_pd(mask, s.W + k);
+      __m512d lj = _mm512_mask_i32gather_pd(zero, mask, j, s.lambda, 8);
+      __m512d q = _mm512_mul_pd(w, inv_W_dq);
+      q = _mm512_mul_pd(q, q);
+      __m512d coef = _mm512_add_pd(_mm512_add_pd(li, lj), _mm512_mul_pd(k_corr, _mm512_mul_pd(q, q)));
+
+      dx = _mm512_fmadd_pd(coef, _mm512_maskz_loadu_pd(mask, s.del_W_x + k), dx);
+      dy = _mm512_fmadd_pd(coef, _mm512_maskz_loadu_pd(mask, s.del_W_y + k), dy);
+      dz = _mm512_fmadd_pd(coef, _mm512_maskz_loadu_pd(mask, s.del_W_z + k), dz);
+    }
+
+    s.delta_p[i] = Vector3D(_mm512_reduce_add_pd(dx), _mm512_reduce_add_pd(dy),
+                            _mm512_reduce_add_pd(dz))/s.rho0;
+  }
+}
+
+
+// Float lanes are summed in double
+__attribute__((target("avx512f")))
+static inline double hsum_avx512(__m512 v) {
+  __m256 lo = _mm512_castps512_ps256(v);
+  __m256 hi = _mm256_castsi256_ps(_mm512_extracti64x4_epi64(_mm512_castps_si512(v), 1));
+  return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_cvtps_pd(lo), _mm512_cvtps_pd(hi)));
+}
+
+// load_positions_avx2 for 16 particles; 128-bit lane l holds j[4l..4l+4)
+__attribute__((target("avx512f")))
+static inline __m512 load_lanes_avx512(const float *x, const uint32_t *j) {
+  __m512 v = _mm512_castps128_ps512(_mm_loadu_ps(x + 3*j[0]));
+  v = _mm512_insertf32x4(v, _mm_loadu_ps(x + 3*j[4]), 1);
+  v = _mm512_insertf32x4(v, _mm_loadu_ps(x + 3*j[8]), 2);
+  return _mm512_insertf32x4(v, _mm_loadu_ps(x + 3*j[12]), 3);
+}
+
+__attribute__((target("avx512f")))
+static inline void load_positions_avx512(const float *x, const uint32_t *j,
+                                         __m512 &px, __m512 &py, __m512 &pz) {
+  __m512 v0 = load_lanes_avx512(x, j);
+  __m512 v1 = load_lanes_avx512(x, j + 1);
+  __m512 v2 = load_lanes_avx512(x, j + 2);
+  __m512 v3 = load_lanes_avx512(x, j + 3);
+  __m512 t0 = _mm512_unpacklo_ps(v0, v1);
+  __m512 t1 = _mm512_unpackhi_ps(v0, v1);
+  __m512 t2 = _mm512_unpacklo_ps(v2, v3);
+  __m512 t3 = _mm512_unpackhi_ps(v2, v3);
+  px = _mm512_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+  py = _mm512_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+  pz = _mm512_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+}
+
+__attribute__((target("avx512f")))
+static void lambdas_avx512(const FusedSweepF &s, const Poly6<float> &poly6, const Spiky<float> &spiky) {
+  const float *x = &s.x_star[0].x;
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 p6_h2 = _mm512_set1_ps(poly6.h2);
+  const __m512 p6_c_W = _mm512_set1_ps(poly6.c_W);
+  const __m512 sp_h = _mm512_set1_ps(spiky.h);
+  const __m512 sp_h2 = _mm512_set1_ps(spiky.h2);
+  const __m512 sp_c_grad = _mm512_set1_ps(spiky.c_grad);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < s.n; i++) {
+    alignas(64) uint32_t j[16];
+    const __m512 xi = _mm512_set1_ps(s.x_star[i].x);
+    const __m512 yi = _mm512_set1_ps(s.x_star[i].y);
+    const __m512 zi = _mm512_set1_ps(s.x_star[i].z);
+    __m512 rho = zero, gx_sum = zero, gy_sum = zero, gz_sum = zero, g2_sum = zero;
+
+    uint32_t last = s.offsets[i + 1];
+    for (uint32_t k = s.offsets[i]; k < last; k += 16) {
+      __mmask16 mask = (__mmask16) ((1u << min(16u, last - k)) - 1);
+      _mm512_store_si512(j, _mm512_maskz_loadu_epi32(mask, s.indices + k));
+
+      __m512 px, py, pz;
+      load_positions_avx512(x, j, px, py, pz);
+      __m512 rx = _mm512_sub_ps(xi, px);
+      __m512 ry = _mm512_sub_ps(yi, py);
+      __m512 rz = _mm512_sub_ps(zi, pz);
+      __m512 r2 = _mm512_fmadd_ps(rx, rx, _mm512_fmadd_ps(ry, ry, _mm512_mul_ps(rz, rz)));
+
+      // Poly6 value
+      __mmask16 w_mask = _mm512_mask_cmp_ps_mask(mask, r2, p6_h2, _CMP_LT_OQ);
+      __m512 d = _mm512_sub_ps(p6_h2, r2);
+      __m512 w = _mm512_maskz_mul_ps(w_mask, p6_c_W, _mm512_mul_ps(d, _mm512_mul_ps(d, d)));
+
+      // Spiky gradient; the self pair (r2 == 0) is masked out with the tail
+      __mmask16 g_mask = _mm512_mask_cmp_ps_mask(mask, r2, sp_h2, _CMP_LT_OQ) &
+                         _mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ);
+      __m512 r = _mm512_sqrt_ps(r2);
+      __m512 e = _mm512_sub_ps(sp_h, r);
+      __m512 gs = _mm512_maskz_div_ps(g_mask, _mm512_mul_ps(sp_c_grad, _mm512_mul_ps(e, e)), r);
+      __m512 gx = _mm512_mul_ps(gs, rx);
+      __m512 gy = _mm512_mul_ps(gs, ry);
+      __m512 gz = _mm512_mul_ps(gs, rz);
+
+      _mm512_mask_storeu_ps(s.W + k, mask, w);
+      _mm512_mask_storeu_ps(s.del_W_x + k, mask, gx);
+      _mm512_mask_storeu_ps(s.del_W_y + k, mask, gy);
+      _mm512_mask_storeu_ps(s.del_W_z + k, mask, gz);
+
+      rho = _mm512_add_ps(rho, w);
+      gx_sum = _mm512_add_ps(gx_sum, gx);
+      gy_sum = _mm512_add_ps(gy_sum, gy);
+      gz_sum = _mm512_add_ps(gz_sum, gz);
+      g2_sum = _mm512_fmadd_ps(gx, gx, _mm512_fmadd_ps(gy, gy, _mm512_fmadd_ps(gz, gz, g2_sum)));
+    }
+
+    double density = hsum_avx512(rho);
+    Vector3D del_i = Vector3D(hsum_avx512(gx_sum), hsum_avx512(gy_sum), hsum_avx512(gz_sum))/s.rho0;
+    double del_j = hsum_avx512(g2_sum)/(s.rho0*s.rho0);
+    double lambda = -(density/s.rho0 - 1.0)/(del_j + del_i.norm2() + s.epsilon);
+    s.density[i] = density;
+    s.lambda[i] = lambda;
+    s.lambda_f[i] = lambda;
+  }
+}
+
+__attribute__((target("avx512f")))
+static void delta_p_avx512(const FusedSweepF &s) {
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 inv_W_dq = _mm512_set1_ps(s.scorr_inv_W);
+  const __m512 k_corr = _mm512_set1_ps(-0.001f);
+
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < s.n; i++) {
+    const __m512 li = _mm512_set1_ps(s.lambda_f[i]);
+    __m512 dx = zero, dy = zero, dz = zero;
+
+    uint32_t last = s.offsets[i + 1];
+    for (uint32_t k = s.offsets[i]; k < last; k += 16) {
+      __mmask16 mask = (__mmask16) ((1u << min(16u, last - k)) - 1);
+      __m512i j = _mm512_maskz_loadu_epi32(mask, s.indices + k);
+
+      __m512 w = _mm512_maskz_loadu_ps(mask, s.W + k);
+      __m512 lj = _mm512_mask_i32gather_ps(zero, mask, j, s.lambda_f, 4);
+      __m512 q = _mm512_mul_ps(w, inv_W_dq);
+      q = _mm512_mul_ps(q, q);
+      __m512 coef = _mm512_add_ps(_mm512_add_ps(li, lj), _mm512_mul_ps(k_corr, _mm512_mul_ps(q, q)));
+
+      dx = _mm512_fmadd_ps(coef, _mm512_maskz_loadu_ps(mask, s.del_W_x + k), dx);
+      dy = _mm512_fmadd_ps(coef, _mm512_maskz_loadu_ps(mask, s.del_W_y + k), dy);
+      dz = _mm512_fmadd_ps(coef, _mm512_maskz_loadu_ps(mask, s.del_W_z + k), dz);
+    }
+
+    s.delta_p[i] = Vector3D(hsum_avx512(dx), hsum_avx512(dy), hsum_avx512(dz))/s.rho0;
+  }
+}
+
+#endif /* FLUID_SIMD_X86 */
+
+void fused_lambdas_simd(e_simd isa, const FusedSweep &s,
+                        const Poly6<double> &poly6, const Spiky<double> &spiky) {
+#ifdef FLUID_SIMD_X86
+  if (isa == SIMD_AVX512) {
+    lambdas_avx512(s, poly6, spiky);
+  } else {
+    lambdas_avx2(s, poly6, spiky);
+  }
+#endif
+}
+
+void fused_delta_p_simd(e_simd isa, const FusedSweep &s) {
+#ifdef FLUID_SIMD_X86
+  if (isa == SIMD_AVX512) {
+    delta_p_avx512(s);
+  } else {
+    delta_p_avx2(s);
+  }
+#endif
+}
+
+void fused_lambdas_simd(e_simd isa, const FusedSweepF &s,
+                        const Poly6<float> &poly6, const Spiky<float> &spiky) {
+#ifdef FLUID_SIMD_X86
+  if (isa == SIMD_AVX512) {
+    lambdas_avx512(s, poly6, spiky);
+  } else {
+    lambdas_avx2(s, poly6, spiky);
+  }
+#endif
+}
+
+void fused_delta_p_simd(e_simd isa, const FusedSweepF &s) {
+#ifdef FLUID_SIMD_X86
+  if (isa == SIMD_AVX512) {
+    delta_p_avx512(s);
+  } else {
+    delta_p_avx2(s);
+  }
+#endif
+}
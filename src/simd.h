@@ -0,0 +1,87 @@
+#ifndef FLUID_SIMD_H
+#define FLUID_SIMD_H
+
+#include <cstdint>
+
+#include "CGL/CGL.h"
+#include "CGL/vector3D.h"
+#include "kernels.h"
+#include "vec3.h"
+
+using namespace CGL;
+
+enum e_simd { SIMD_SCALAR = 0, SIMD_AVX2 = 1, SIMD_AVX512 = 2 };
+
+// Widest instruction set that both this CPU and the sweeps below support
+e_simd detect_simd();
+const char *simd_name(e_simd isa);
+
+/*
+  Arrays one fused-solver sweep reads and writes, as raw pointers so the
+  vectorized sweeps need nothing from Fluid. W and del_W_* are the pair
+  cache, one entry per CSR entry of offsets/indices.
+*/
+struct FusedSweep {
+  long n;
+  const uint32_t *offsets;
+  const uint32_t *indices;
+  const Vector3D *x_star;
+  double *density;
+  double *lambda;
+  Vector3D *delta_p;
+  double *W;
+  double *del_W_x;
+  double *del_W_y;
+  double *del_W_z;
+  double rho0;
+  double epsilon;
+  double scorr_inv_W;
+};
+
+/*
+  Hand-vectorized double-precision versions of Fluid::update_lambdas_fused
+  and update_delta_p_fused for the Poly6/Spiky pair. Each neighbor list is
+  walked in batches of 4 (AVX2) or 8 (AVX-512) CSR entries: neighbor
+  positions and lambdas are gathered by index and the last batch is masked.
+  Results match the scalar sweeps up to summation order. isa must not be
+  SIMD_SCALAR.
+*/
+void fused_lambdas_simd(e_simd isa, const FusedSweep &s,
+                        const Poly6<double> &poly6, const Spiky<double> &spiky);
+void fused_delta_p_simd(e_simd isa, const FusedSweep &s);
+
+/*
+  Single-precision counterpart of FusedSweep. Neighbors are read from the
+  store's float mirrors of x_star and lambda, and the pair cache is float;
+  density, lambda and delta_p are still written back in double. x_star
+  needs one spare entry past the last particle.
+*/
+struct FusedSweepF {
+  long n;
+  const uint32_t *offsets;
+  const uint32_t *indices;
+  const Vec3<float> *x_star;
+  float *lambda_f;
+  double *density;
+  double *lambda;
+  Vector3D *delta_p;
+  float *W;
+  float *del_W_x;
+  float *del_W_y;
+  float *del_W_z;
+  double rho0;
+  double epsilon;
+  float scorr_inv_W;
+};
+
+/*
+  Float versions of the sweeps above, 8 (AVX2) or 16 (AVX-512) CSR entries
+  per batch. Neighbor positions are loaded 16 bytes at a time and
+  transposed rather than gathered. Kernel terms are summed per lane in
+  float and across lanes in double.
+*/
+void fused_lambdas_simd(e_simd isa, const FusedSweepF &s,
+                        const Poly6<float> &poly6, const Spiky<float> &spiky);
+void fused_delta_p_simd(e_simd isa, const FusedSweepF &s);
+
+#endif /* FLUID_SIMD_H */
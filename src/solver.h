@@ -0,0 +1,101 @@
+#ifndef FLUID_SOLVER_H
+#define FLUID_SOLVER_H
+
+#include <vector>
+
+#include "CGL/CGL.h"
+#include "CGL/vector3D.h"
+#include "collision/collisionObject.h"
+
+using namespace CGL;
+using namespace std;
+
+struct Fluid;
+
+enum e_solver { PBF_SOLVER = 0, DFSPH_SOLVER = 1 };
+
+/*
+  Pressure solver run by Fluid::advance. A solver owns one step from the
+  positions in origin to new positions in x_star and velocities: it builds
+  the neighbor lists, applies external accelerations, viscosity, vorticity
+  and the collision objects, and enforces incompressibility its own way.
+  Everything it touches lives in the Fluid, so solvers share the particle
+  store, neighbor search and colliders and can be swapped per scene.
+*/
+class FluidSolver {
+public:
+  virtual ~FluidSolver() {}
+  virtual const char *name() const = 0;
+  // frame < 0 skips the voxel export
+  virtual void step(Fluid &fluid, double delta_t, vector<Vector3D> &external_accelerations,
+                    vector<CollisionObject *> *collision_objects, int frame) = 0;
+  // Prints and clears whatever the solver counted since the last reset
+  virtual void reset() {}
+};
+
+// Iterations PBFSolver over-relaxed under Fluid::chebyshev
+struct ChebyshevStats {
+  size_t steps = 0;        // steps that got past chebyshev_delay
+  size_t accelerated = 0;  // iterations run with a Chebyshev weight
+  size_t fallbacks = 0;    // steps that dropped back to plain Jacobi
+  double rho_sum = 0;      // spectral radius each step used
+};
+
+// Position-based fluids: Jacobi iterations on lambda and delta_p
+class PBFSolver : public FluidSolver {
+public:
+  const char *name() const { return "PBF"; }
+  void step(Fluid &fluid, double delta_t, vector<Vector3D> &external_accelerations,
+            vector<CollisionObject *> *collision_objects, int frame);
+  void reset();
+
+  ChebyshevStats stats;
+
+private:
+  vector<Vector3D> previous; // iterate before x_star under chebyshev
+};
+
+// Iterations run per step by DFSPHSolver
+struct DFSPHStats {
+  size_t steps = 0;
+  size_t density_iterations = 0;
+  size_t divergence_iterations = 0;
+  double density_error_sum = 0;     // mean predicted compression each step ended at
+  double divergence_error_sum = 0;  // mean compression rate times delta_t
+};
+
+/*
+  Divergence-free SPH (Bender and Koschier). Each step starts at the
+  current positions: the divergence solver removes compression rate from
+  the velocities, then non-pressure forces are applied, and the density
+  solver corrects the velocities until the density predicted for the end of
+  the step is within tolerance of the rest density. Both solvers share one
+  pressure sweep, and the kernel gradient of every neighbor pair is cached
+  by the density sweep at the start of the step. Unlike PBF it does not
+  damp what a too-long step gets wrong, so Fluid::init_solver turns
+  adaptive_dt on for it.
+*/
+class DFSPHSolver : public FluidSolver {
+public:
+  const char *name() const { return "DFSPH"; }
+  void step(Fluid &fluid, double delta_t, vector<Vector3D> &external_accelerations,
+            vector<CollisionObject *> *collision_objects, int frame);
+  void reset();
+
+  DFSPHStats stats;
+
+private:
+  void compute_density_alpha(Fluid &fluid);
+  // Mean of the compression rate, written to source; with predict the
+  // source becomes the density predicted after delta_t, clamped at rest
+  double update_source(Fluid &fluid, double delta_t, bool predict);
+  // Velocity correction for the pressure-like kappa = source*alpha*scale
+  void pressure_sweep(Fluid &fluid, double delta_t, double scale);
+
+  vector<double> alpha;
+  vector<double> source;
+  vector<double> kappa;
+  vector<Vector3D> grad_W; // mass times grad W for every CSR entry
+};
+
+#endif /* FLUID_SOLVER_H */
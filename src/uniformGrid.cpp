@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "uniformGrid.h"
+
+using namespace std;
+
+// Upper bound on grid cells per particle. A few stray particles far from the
+// fluid would otherwise blow up the cell array, so the cells grow instead.
+#define GRID_CELLS_PER_PARTICLE 8
+#define GRID_MIN_CELLS (1 << 16)
+
+void UniformGrid::build(const vector<Vector3D> &positions, double cell_size) {
+  this->positions = &positions;
+  size_t n = positions.size();
+
+  Vector3D lo(DBL_MAX, DBL_MAX, DBL_MAX);
+  Vector3D hi(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+  for (const Vector3D &x : positions) {
+    for (int a = 0; a < 3; a++) {
+      lo[a] = min(lo[a], x[a]);
+      hi[a] = max(hi[a], x[a]);
+    }
+  }
+  if (n == 0) lo = hi = Vector3D(0, 0, 0);
+
+  // Cells may be larger than the search radius (the 27-cell scan stays
+  // exact), but never smaller.
+  double max_cells = max((double) GRID_MIN_CELLS, (double) GRID_CELLS_PER_PARTICLE * n);
+  Vector3D extent = hi - lo;
+  double volume = (extent.x + cell_size) * (extent.y + cell_size) * (extent.z + cell_size);
+  if (volume / (cell_size * cell_size * cell_size) > max_cells) {
+    cell_size = cbrt(volume / max_cells);
+  }
+
+  this->cell_size = cell_size;
+  min_corner = lo;
+  for (int a = 0; a < 3; a++) dims[a] = (int) floor(extent[a] / cell_size) + 1;
+  size_t num_cells = (size_t) dims[0] * dims[1] * dims[2];
+
+  // Counting sort of particle indices by cell key
+  keys.resize(n);
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < (long) n; i++) {
+    const Vector3D &x = positions[i];
+    keys[i] = cell_key(cell_coord(x.x, 0), cell_coord(x.y, 1), cell_coord(x.z, 2));
+  }
+  cell_start.assign(num_cells + 1, 0);
+  for (size_t i = 0; i < n; i++) cell_start[keys[i] + 1]++;
+  for (size_t c = 0; c < num_cells; c++) cell_start[c + 1] += cell_start[c];
+
+  sorted.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    // cell_start[key] is used as the insertion cursor and restored below
+    sorted[cell_start[keys[i]]++] = i;
+  }
+  for (size_t c = num_cells; c > 0; c--) cell_start[c] = cell_start[c - 1];
+  cell_start[0] = 0;
+}
+
+void UniformGrid::permute(const vector<uint32_t> &order, const vector<uint32_t> &new_index) {
+  for (uint32_t &j : sorted) j = new_index[j];
+  vector<uint32_t> new_keys(keys.size());
+  for (size_t i = 0; i < order.size(); i++) new_keys[i] = keys[order[i]];
+  keys.swap(new_keys);
+}
+
+int UniformGrid::cell_coord(double x, int axis) const {
+  int c = (int) floor((x - min_corner[axis]) / cell_size);
+  return max(0, min(dims[axis] - 1, c));
+}
+
+size_t UniformGrid::radiusSearch(const double *query_pt, double radius2,
+                                 vector<pair<size_t, double>> &matches) const {
+  matches.clear();
+  if (positions == NULL || positions->empty()) return 0;
+
+  // Cells at least as large as the radius need only a one-cell halo
+  int reach = (int) ceil(sqrt(radius2) / cell_size);
+  int lo[3], hi[3];
+  for (int a = 0; a < 3; a++) {
+    int c = (int) floor((query_pt[a] - min_corner[a]) / cell_size);
+    lo[a] = max(0, c - reach);
+    hi[a] = min(dims[a] - 1, c + reach);
+  }
+
+  const vector<Vector3D> &pts = *positions;
+  for (int z = lo[2]; z <= hi[2]; z++) {
+    for (int y = lo[1]; y <= hi[1]; y++) {
+      size_t row = cell_key(0, y, z);
+      for (size_t k = cell_start[row + lo[0]]; k < cell_start[row + hi[0] + 1]; k++) {
+        uint32_t j = sorted[k];
+        const Vector3D &x = pts[j];
+        double dx = query_pt[0] - x.x;
+        double dy = query_pt[1] - x.y;
+        double dz = query_pt[2] - x.z;
+        double dist2 = dx * dx + dy * dy + dz * dz;
+        if (dist2 < radius2) matches.emplace_back(j, dist2);
+      }
+    }
+  }
+  return matches.size();
+}
+
+static uint64_t spread_bits(uint32_t v) {
+  uint64_t x = v & 0x1fffff;
+  x = (x | x << 32) & 0x1f00000000ffffULL;
+  x = (x | x << 16) & 0x1f0000ff0000ffULL;
+  x = (x | x << 8) & 0x100f00f00f00f00fULL;
+  x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+  x = (x | x << 2) & 0x1249249249249249ULL;
+  return x;
+}
+
+uint64_t morton_code(uint32_t x, uint32_t y, uint32_t z) {
+  return spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+}
@@ -0,0 +1,51 @@
+#ifndef FLUID_UNIFORM_GRID_H
+#define FLUID_UNIFORM_GRID_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "CGL/CGL.h"
+#include "CGL/vector3D.h"
+
+using namespace CGL;
+using namespace std;
+
+/*
+  Uniform grid neighbor search.
+
+  Particles are binned into cubic cells of side cell_size with a counting
+  sort over integer cell keys, so every particle within cell_size of a query
+  point lives in one of the 27 cells around it. radiusSearch mirrors the
+  nanoflann call used by Fluid::build_index so either structure can back it.
+*/
+struct UniformGrid {
+  void build(const vector<Vector3D> &positions, double cell_size);
+
+  size_t radiusSearch(const double *query_pt, double radius2,
+                      vector<pair<size_t, double>> &matches) const;
+
+  // Renumbers binned particles after Fluid reorders them
+  void permute(const vector<uint32_t> &order, const vector<uint32_t> &new_index);
+
+  int cell_coord(double x, int axis) const;
+  size_t cell_key(int x, int y, int z) const {
+    return (size_t) x + dims[0] * ((size_t) y + dims[1] * (size_t) z);
+  }
+
+  double cell_size = 0;
+  Vector3D min_corner;
+  int dims[3] = {0, 0, 0};
+
+  const vector<Vector3D> *positions = NULL;
+
+  // cell_start[c] .. cell_start[c+1] indexes the particles of cell c in sorted
+  vector<uint32_t> cell_start;
+  vector<uint32_t> sorted;
+  vector<uint32_t> keys;
+};
+
+// Interleaves the low 21 bits of each cell coordinate into a Z-order key
+uint64_t morton_code(uint32_t x, uint32_t y, uint32_t z);
+
+#endif /* FLUID_UNIFORM_GRID_H */
@@ -28,25 +28,24 @@
 
 #include <cstdlib>
 #include <iostream>
-#include "collision/collisionObject.h"
-#include "collision/particle.h"
+#include "CGL/vector3D.h"
 
+// Exposes the fluid's own position array to nanoflann without copying it
 struct PointCloud
 {
 
-	std::vector<Particle>  pts;
+	const CGL::Vector3D *pts = NULL;
+	size_t count = 0;
 
 	// Must return the number of data points
-	inline size_t kdtree_get_point_count() const { return pts.size(); }
+	inline size_t kdtree_get_point_count() const { return count; }
 
 	// Returns the dim'th component of the idx'th point in the class:
 	// Since this is inlined and the "dim" argument is typically an immediate value, the
 	//  "if/else's" are actually solved at compile time.
 	inline double kdtree_get_pt(const size_t idx, int dim) const
 	{
-		if (dim == 0) return pts[idx].x_star.x;
-		else if (dim == 1) return pts[idx].x_star.y;
-		else return pts[idx].x_star.z;
+		return pts[idx][dim];
 	}
 
 	// Optional bounding-box computation: return false to default to a standard bbox computation loop.
@@ -0,0 +1,36 @@
+#ifndef FLUID_VEC3_H
+#define FLUID_VEC3_H
+
+#include "CGL/CGL.h"
+#include "CGL/vector3D.h"
+
+using namespace CGL;
+
+/*
+  Minimal 3-vector templated on the scalar type, for solver scratch arrays
+  that are kept at lower precision than CGL::Vector3D. Converts to and
+  from Vector3D at the edges of a sweep.
+*/
+template <typename Real>
+struct Vec3 {
+  Vec3() : x(0), y(0), z(0) {}
+  Vec3(Real x, Real y, Real z) : x(x), y(y), z(z) {}
+  explicit Vec3(const Vector3D &v) : x(v.x), y(v.y), z(v.z) {}
+
+  Vector3D to_vector3D() const { return Vector3D(x, y, z); }
+
+  Vec3 operator+(const Vec3 &v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
+  Vec3 operator-(const Vec3 &v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
+  Vec3 operator*(Real s) const { return Vec3(x * s, y * s, z * s); }
+  Vec3 &operator+=(const Vec3 &v) { x += v.x; y += v.y; z += v.z; return *this; }
+  Vec3 &operator-=(const Vec3 &v) { x -= v.x; y -= v.y; z -= v.z; return *this; }
+
+  Real norm2() const { return x * x + y * y + z * z; }
+
+  Real x, y, z;
+};
+
+template <typename Real>
+inline Vec3<Real> operator*(Real s, const Vec3<Real> &v) { return v * s; }
+
+#endif /* FLUID_VEC3_H */